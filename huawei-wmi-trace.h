@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  Huawei WMI laptop extras driver tracepoints
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM huawei_wmi
+
+#if !defined(_HUAWEI_WMI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HUAWEI_WMI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* HWMI_SHAPE_* come from huawei-wmi.c, defined before including us. */
+TRACE_DEFINE_ENUM(HWMI_SHAPE_NONE);
+TRACE_DEFINE_ENUM(HWMI_SHAPE_BUFFER);
+TRACE_DEFINE_ENUM(HWMI_SHAPE_PACKAGE);
+
+#define show_hwmi_shape(shape)					\
+	__print_symbolic(shape,					\
+		{ HWMI_SHAPE_NONE,	"none" },		\
+		{ HWMI_SHAPE_BUFFER,	"buffer" },		\
+		{ HWMI_SHAPE_PACKAGE,	"package" })
+
+TRACE_EVENT(huawei_wmi_cmd_issue,
+	TP_PROTO(u64 arg),
+	TP_ARGS(arg),
+
+	TP_STRUCT__entry(
+		__field(u16, cmd)
+		__field(u64, arg)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = arg & 0xffff;
+		__entry->arg = arg;
+	),
+
+	TP_printk("cmd=0x%04x arg=0x%016llx", __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(huawei_wmi_cmd_retry,
+	TP_PROTO(u64 arg, u8 status),
+	TP_ARGS(arg, status),
+
+	TP_STRUCT__entry(
+		__field(u16, cmd)
+		__field(u64, arg)
+		__field(u8, status)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = arg & 0xffff;
+		__entry->arg = arg;
+		__entry->status = status;
+	),
+
+	TP_printk("cmd=0x%04x arg=0x%016llx status=0x%02x",
+		__entry->cmd, __entry->arg, __entry->status)
+);
+
+TRACE_EVENT(huawei_wmi_cmd_complete,
+	TP_PROTO(u64 arg, u8 status, int shape, int retries, u64 duration,
+		int err),
+	TP_ARGS(arg, status, shape, retries, duration, err),
+
+	TP_STRUCT__entry(
+		__field(u16, cmd)
+		__field(u64, arg)
+		__field(u8, status)
+		__field(int, shape)
+		__field(int, retries)
+		__field(u64, duration)
+		__field(int, err)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = arg & 0xffff;
+		__entry->arg = arg;
+		__entry->status = status;
+		__entry->shape = shape;
+		__entry->retries = retries;
+		__entry->duration = duration;
+		__entry->err = err;
+	),
+
+	TP_printk("cmd=0x%04x arg=0x%016llx status=0x%02x shape=%s retries=%d duration=%lluns err=%d",
+		__entry->cmd, __entry->arg, __entry->status,
+		show_hwmi_shape(__entry->shape), __entry->retries,
+		__entry->duration, __entry->err)
+);
+
+TRACE_EVENT(huawei_wmi_key,
+	TP_PROTO(int scancode, unsigned int keycode, bool filtered),
+	TP_ARGS(scancode, keycode, filtered),
+
+	TP_STRUCT__entry(
+		__field(int, scancode)
+		__field(unsigned int, keycode)
+		__field(bool, filtered)
+	),
+
+	TP_fast_assign(
+		__entry->scancode = scancode;
+		__entry->keycode = keycode;
+		__entry->filtered = filtered;
+	),
+
+	TP_printk("scancode=0x%04x keycode=%u filtered=%d",
+		__entry->scancode, __entry->keycode, __entry->filtered)
+);
+
+#endif /* _HUAWEI_WMI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE huawei-wmi-trace
+
+#include <trace/define_trace.h>
@@ -6,24 +6,60 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/completion.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dmi.h>
 #include <linux/input.h>
 #include <linux/input/sparse-keymap.h>
+#include <linux/ktime.h>
 #include <linux/leds.h>
+#include <linux/log2.h>
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/power_supply.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 #include <linux/wmi.h>
+#include <linux/workqueue.h>
 #include <linux/hwmon.h>
 #include <linux/version.h>
 #include <acpi/battery.h>
 #include <linux/version.h>
 
+/* Shape of the HWMI response */
+enum {
+	HWMI_SHAPE_NONE,
+	HWMI_SHAPE_BUFFER,
+	HWMI_SHAPE_PACKAGE,
+};
+
+#define CREATE_TRACE_POINTS
+#include "huawei-wmi-trace.h"
+
 #define HWMI_BUFF_SIZE 0x100
+#define HWMI_CACHE_SIZE 32
+#define HWMI_CMD_SIZE 32
+#define HWMI_FLIGHT_POOL 4
+#define HWMI_LAT_BUCKETS 24
+#define HWMI_SLOW_LOG 8
+#define HWMI_UTIL_SECS 60
+#define HWMI_REC_RESP 32
+#define HWMI_REPLAY_MAX 4096
+
+/* Largest response we expect: a package of a 4 and a 256 bytes buffers. It also
+ * fits the single 0x104 bytes buffer some models return.
+ */
+#define HWMI_RESP_SIZE (3 * sizeof(union acpi_object) + \
+		ACPI_ROUND_UP_TO_NATIVE_WORD(4) + \
+		ACPI_ROUND_UP_TO_NATIVE_WORD(HWMI_BUFF_SIZE + 4))
 
 /*
  * Huawei WMI GUIDs
@@ -67,6 +103,57 @@ union hwmi_arg {
 	u8 args[8];
 };
 
+/* Commands with their own counters, anything else is counted as "other". */
+static const struct {
+	u16 cmd;
+	const char *name;
+} hwmi_cmd_names[] = {
+	{ BATTERY_THRESH_GET, "battery_thresh_get" },
+	{ BATTERY_THRESH_SET, "battery_thresh_set" },
+	{ FN_LOCK_GET, "fn_lock_get" },
+	{ FN_LOCK_SET, "fn_lock_set" },
+	{ KBDLIGHT_GET, "kbdlight_get" },
+	{ KBDLIGHT_SET, "kbdlight_set" },
+	{ MICMUTE_LED_SET, "micmute_led_set" },
+	{ KBDLIGHT_TIMEOUT_SET, "kbdlight_timeout_set" },
+	{ KBDLIGHT_TIMEOUT_GET, "kbdlight_timeout_get" },
+	{ KBDLIGHT_MODE_GET, "kbdlight_mode_get" },
+	{ KBDLIGHT_MODE_SET, "kbdlight_mode_set" },
+	{ KBDLIGHT_SET_AUTO, "kbdlight_set_auto" },
+	{ POWER_UNLOCK_SET, "power_unlock_set" },
+	{ POWER_UNLOCK_GET, "power_unlock_get" },
+	{ FAN_SPEED_GET, "fan_speed_get" },
+	{ TEMP_GET, "temp_get" },
+	{ TOUCHPAD_GET, "touchpad_get" },
+	{ TOUCHPAD_SET, "touchpad_set" },
+	{ BATTERY_CHARGE_MODE_GET, "charge_mode_get" },
+	{ BATTERY_CHARGE_MODE_SET, "charge_mode_set" },
+	{ BATTERY_CHARGE_MODE_PARAM_GET, "charge_mode_param_get" },
+	{ BATTERY_CHARGE_MODE_PARAM_SET, "charge_mode_param_set" },
+};
+
+#define HWMI_STAT_CMDS (ARRAY_SIZE(hwmi_cmd_names) + 1)
+
+/* A command as stored by the recorder, read from debugfs/huawei-wmi/recorder
+ * and loaded into debugfs/huawei-wmi/fake/replay. Little endian, 64 bytes.
+ */
+struct hwmi_rec {
+	__le64 ts;		/* ktime_get_ns() when it was issued */
+	__le64 arg;		/* command and arguments */
+	__le64 duration;	/* ns spent evaluating, retries included */
+	__le32 err;		/* negative errno */
+	u8 len;			/* valid bytes in resp */
+	u8 prio;		/* HWMI_PRIO_* */
+	u8 shape;		/* HWMI_SHAPE_* */
+	u8 retries;
+	u8 resp[HWMI_REC_RESP];	/* start of the response, status included */
+};
+
+/* Called with the len bytes HWMI response, status byte included, of a
+ * successful command. It may run under a spinlock and must not sleep.
+ */
+typedef void (*hwmi_decode_t)(const u8 *resp, size_t len, void *ctx);
+
 struct quirk_entry {
 	bool battery_reset;
 	bool ec_micmute;
@@ -83,6 +170,396 @@ struct huawei_wmi_debug {
 	u64 arg;
 };
 
+struct huawei_wmi_cache_entry {
+	u64 arg;
+	unsigned long expires;
+	bool valid;
+	u8 buf[HWMI_BUFF_SIZE];
+};
+
+struct huawei_wmi_cache {
+	spinlock_t lock;
+	unsigned int gen;
+	u64 hits;
+	u64 misses;
+	struct huawei_wmi_cache_entry entries[HWMI_CACHE_SIZE];
+};
+
+/* A GET that is waiting for wmi_lock or being evaluated. Identical GETs
+ * arriving meanwhile wait for its response instead of issuing their own.
+ */
+struct huawei_wmi_flight {
+	struct list_head list;
+	u64 arg;
+	unsigned int gen;	/* cache generation when the GET started */
+	int prio;
+	int ref;		/* protected by huawei_wmi_flights.lock, 0 if free */
+	struct completion done;
+	int err;
+	size_t len;
+	u8 buf[HWMI_BUFF_SIZE];
+};
+
+/* Flights come from a small pool so GETs don't allocate. When it runs out,
+ * GETs are evaluated on their own.
+ */
+struct huawei_wmi_flights {
+	spinlock_t lock;
+	struct list_head list;
+	struct huawei_wmi_flight pool[HWMI_FLIGHT_POOL];
+	u64 issued;
+	u64 saved;
+	u64 exhausted;
+};
+
+enum {
+	HWMI_RETRY_AUTO,
+	HWMI_RETRY_ALWAYS,
+	HWMI_RETRY_NEVER,
+};
+
+/* log2 histogram of latencies in microseconds, all other values are in ns. */
+struct huawei_wmi_lat {
+	u64 count;
+	u64 min;
+	u64 max;
+	u64 sum;
+	u32 buckets[HWMI_LAT_BUCKETS];
+};
+
+struct huawei_wmi_cmd_entry {
+	u16 cmd;
+
+	/* Retry policy */
+	u8 mode;
+	u32 failed;	/* first evaluation returned a non-zero status */
+	u32 recovered;	/* ...and the second one succeeded */
+
+	/* Latency */
+	struct huawei_wmi_lat wait;	/* waiting on wmi_lock */
+	struct huawei_wmi_lat eval;	/* evaluating HWMI, retries included */
+};
+
+/* Per command code state, protected by wmi_lock. */
+struct huawei_wmi_cmds {
+	unsigned int count;
+	struct huawei_wmi_cmd_entry entries[HWMI_CMD_SIZE];
+};
+
+enum {
+	HWMI_STAT_CALLS,
+	HWMI_STAT_OK,
+	HWMI_STAT_STATUS,	/* non-zero return status */
+	HWMI_STAT_EIO,		/* unexpected response shape */
+	HWMI_STAT_RETRIES,
+	HWMI_STAT_CACHE_HITS,
+	HWMI_STAT_MAX,
+};
+
+/* Per-CPU command counters, summed up on read. */
+struct huawei_wmi_stats {
+	u64 count[HWMI_STAT_CMDS][HWMI_STAT_MAX];
+};
+
+/* ACPI methods looked up once at probe */
+enum {
+	HWMI_CAP_SMLS,		/* micmute LED */
+	HWMI_CAP_SKBL,		/* keyboard backlight */
+	HWMI_CAP_SPIN,		/* EC micmute LED, newer */
+	HWMI_CAP_WPIN,		/* EC micmute LED, older */
+	HWMI_CAP_MAX,
+};
+
+/* An argument discovery issued, keyed whole as fan and sensor numbers fail
+ * on their own.
+ */
+struct huawei_wmi_caps_cmd {
+	u64 arg;
+	bool missing;
+};
+
+/* What the firmware was found to have. An argument that fails during probe
+ * is not issued again, callers get -ENODEV right away.
+ */
+struct huawei_wmi_caps {
+	acpi_handle ec;
+	unsigned long methods;			/* BIT(HWMI_CAP_*) */
+	unsigned int count;
+	struct huawei_wmi_caps_cmd cmds[HWMI_CMD_SIZE];
+};
+
+/* Last known values, indices into huawei_wmi_snapshot.val */
+enum {
+	HWMI_STATE_FN_LOCK,
+	HWMI_STATE_KBDLIGHT,
+	HWMI_STATE_KBDLIGHT_TIMEOUT,
+	HWMI_STATE_POWER_UNLOCK,
+	HWMI_STATE_BATTERY_START,
+	HWMI_STATE_BATTERY_END,
+	HWMI_STATE_FAN,				/* by fan number */
+	HWMI_STATE_TEMP = HWMI_STATE_FAN + 2,	/* by sensor number */
+	HWMI_STATE_MAX = HWMI_STATE_TEMP + 0x20,
+};
+
+/* Attributes that can be served from the snapshot, see hwmi_snap_modes */
+enum {
+	HWMI_SNAP_FN_LOCK,
+	HWMI_SNAP_KBDLIGHT,
+	HWMI_SNAP_KBDLIGHT_TIMEOUT,
+	HWMI_SNAP_POWER_UNLOCK,
+	HWMI_SNAP_BATTERY,
+	HWMI_SNAP_FAN,
+	HWMI_SNAP_TEMP,
+	HWMI_SNAP_MAX,
+};
+
+/* Published by whoever learns a new value, the getters and setters.
+ * Readers retry instead of waiting on wmi_lock.
+ */
+struct huawei_wmi_snapshot {
+	seqlock_t lock;
+	DECLARE_BITMAP(valid, HWMI_STATE_MAX);
+	int val[HWMI_STATE_MAX];
+	unsigned long stamp[HWMI_STATE_MAX];	/* jiffies when published */
+};
+
+/* Circuit breaker states */
+enum {
+	HWMI_BREAKER_CLOSED,
+	HWMI_BREAKER_OPEN,	/* short-circuited until it's probed */
+	HWMI_BREAKER_PROBE,	/* being probed in the background */
+};
+
+/* A GET, keyed by its full argument, that failed lately. */
+struct huawei_wmi_breaker_entry {
+	u64 arg;
+	bool valid;
+	int state;
+	unsigned int fails;	/* consecutive */
+	int err;		/* returned while open */
+	u32 backoff_ms;
+	unsigned long until;
+};
+
+struct huawei_wmi_breaker {
+	spinlock_t lock;
+	struct delayed_work work;
+	u32 threshold;		/* consecutive failures to open, 0 disables */
+	u32 backoff_ms;		/* first backoff, doubled on each failed probe */
+	u32 backoff_max_ms;
+	bool armed;		/* work is scheduled for next */
+	unsigned long next;
+	u64 trips;
+	u64 rejected;
+	struct huawei_wmi_breaker_entry entries[HWMI_CMD_SIZE];
+};
+
+enum {
+	HWMI_ASYNC_KBDLIGHT,
+	HWMI_ASYNC_KBDLIGHT_TIMEOUT,
+	HWMI_ASYNC_FN_LOCK,
+	HWMI_ASYNC_POWER_UNLOCK,
+	HWMI_ASYNC_BATTERY,
+	HWMI_ASYNC_MAX,
+};
+
+struct huawei_wmi_async_slot {
+	bool pending;
+	int value[2];
+	int err;	/* error of the last write, reported on the next read */
+
+	/* Token bucket, in ns of credit */
+	u32 rate;	/* writes per second, 0 doesn't limit */
+	u32 burst;	/* writes that can be saved up */
+	u64 credit;
+	u64 stamp;
+	u64 throttled;
+};
+
+/* Write-back queue for sysfs setters, one slot per feature. */
+struct huawei_wmi_async {
+	spinlock_t lock;
+	struct mutex apply_lock;	/* writes land in the order they're taken */
+	struct delayed_work work;
+	bool draining;	/* apply everything, budget or not */
+	struct huawei_wmi_async_slot slots[HWMI_ASYNC_MAX];
+	u64 queued;
+	u64 coalesced;
+};
+
+/* Command priority classes, in the order they get wmi_lock. */
+enum {
+	HWMI_PRIO_INTERACTIVE,	/* input and LEDs */
+	HWMI_PRIO_CONTROL,	/* sysfs */
+	HWMI_PRIO_BACKGROUND,	/* hwmon and probe */
+	HWMI_PRIO_MAX,
+};
+
+struct huawei_wmi_sched_stats {
+	u64 count;
+	u64 wait_sum;
+	u64 wait_max;
+	u64 timeouts;
+};
+
+/* Hands wmi_lock out by priority class rather than in mutex order. */
+struct huawei_wmi_sched {
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	bool busy;
+	unsigned int waiting[HWMI_PRIO_MAX];
+	struct huawei_wmi_sched_stats stats[HWMI_PRIO_MAX];
+};
+
+struct huawei_wmi_slow {
+	u64 arg;
+	u64 duration;		/* ns */
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+};
+
+/* Tracks the evaluation in progress so a stalled EC doesn't hold everyone
+ * behind wmi_lock for good.
+ */
+struct huawei_wmi_watchdog {
+	spinlock_t lock;
+	u32 slow_ms;		/* evaluations taking longer are slow, 0 disables */
+	u32 read_ms;		/* lock timeout of GETs, 0 waits forever */
+	u32 interactive_ms;	/* lock timeout of interactive commands */
+	u64 start;		/* of the evaluation in progress, 0 if idle */
+	struct huawei_wmi_slow cur;
+	u64 slow;
+	u64 busy;
+	unsigned int next;
+	struct huawei_wmi_slow log[HWMI_SLOW_LOG];
+};
+
+/* Who the EC time goes to */
+enum {
+	HWMI_FEAT_NONE = -1,
+	HWMI_FEAT_BATTERY,
+	HWMI_FEAT_HWMON,
+	HWMI_FEAT_KBDLIGHT,
+	HWMI_FEAT_INPUT,
+	HWMI_FEAT_DEBUGFS,
+	HWMI_FEAT_OTHER,
+	HWMI_FEAT_MAX,
+};
+
+struct huawei_wmi_util_bucket {
+	u64 sec;		/* since boot, of the second it accounts */
+	u64 busy;		/* ns */
+	u32 calls;
+};
+
+/* Evaluation time and count per feature, in one second buckets. The ring holds
+ * one more second than the longest window, so the second still being filled
+ * never lands in the oldest bucket of a full window.
+ */
+struct huawei_wmi_util {
+	spinlock_t lock;
+	u64 busy[HWMI_FEAT_MAX];
+	u64 calls[HWMI_FEAT_MAX];
+	struct huawei_wmi_util_bucket buckets[HWMI_FEAT_MAX][HWMI_UTIL_SECS + 1];
+};
+
+struct huawei_wmi_lockstat_feat {
+	u64 acquired;
+	u64 contended;		/* had to wait for another holder */
+	u64 wait_sum, wait_max;	/* ns */
+	u64 hold_sum, hold_max;	/* ns */
+};
+
+/* wmi_lock acquisitions per feature, charged on release. Debugfs readers
+ * take the mutex directly and aren't counted.
+ */
+struct huawei_wmi_lockstat {
+	spinlock_t lock;
+	struct huawei_wmi_lockstat_feat feat[HWMI_FEAT_MAX];
+
+	/* Current holder, protected by wmi_lock */
+	u64 acquired;
+	u64 wait;
+	bool contended;
+	int feat_cur;		/* HWMI_FEAT_*, set by the first command */
+};
+
+/* A recorded command reissued by debugfs/huawei-wmi/fake/replay_start. */
+struct huawei_wmi_replay_work {
+	struct delayed_work work;
+	struct huawei_wmi *huawei;
+	u64 arg;
+	int prio;
+};
+
+/* In-kernel model of the HWMI method, see huawei_wmi_fake_evaluate(). State
+ * is protected by wmi_lock, the knobs are set from debugfs.
+ */
+
+struct huawei_wmi_fake {
+	/* Knobs */
+	u32 shape;		/* HWMI_SHAPE_BUFFER or HWMI_SHAPE_PACKAGE */
+	u32 latency_us;		/* per evaluation */
+	u32 err_every;		/* fail every Nth evaluation, 0 disables */
+	u32 err_cmd;		/* always fail this command code, 0 disables */
+	bool retry_quirk;	/* first evaluation of each command fails */
+
+	/* EC state */
+	u64 evals;
+	u64 last_arg;
+	u8 battery[2];
+	u8 charge_mode[4];
+	u8 charge_param;
+	u8 fn_lock;
+	u8 kbdlight;
+	u8 kbdlight_mode;
+	u8 kbdlight_auto;
+	u16 kbdlight_timeout;
+	u8 power_unlock;
+	u8 micmute;
+	u8 touchpad;
+	u8 fans;
+	u16 fan_rpm[2];
+	u8 temp[0x20];
+
+	/* Recorded traffic. Commands found in it are answered with the
+	 * recorded response after the recorded duration.
+	 */
+	struct hwmi_rec *replay;	/* protected by wmi_lock */
+	unsigned int replay_count;
+	unsigned int replay_cursor;
+	u64 replayed;
+	struct mutex replay_lock;	/* protects replay_works */
+	struct huawei_wmi_replay_work *replay_works;
+	unsigned int replay_works_count;
+};
+
+/* Lock-free for readers: the only writer holds wmi_lock and readers drop any
+ * record that was overwritten while they copied it.
+ */
+struct huawei_wmi_recorder {
+	struct hwmi_rec *recs;
+	unsigned int size;	/* power of 2, 0 if disabled */
+	u64 head;		/* records written */
+	u64 writing;		/* record being written, plus one */
+};
+
+struct huawei_wmi;
+
+struct huawei_wmi_ops {
+	const char *name;
+	bool (*present)(struct huawei_wmi *huawei);
+	acpi_status (*evaluate)(struct huawei_wmi *huawei,
+			const struct acpi_buffer *in, struct acpi_buffer *out);
+};
+
+/* Preallocated response buffer, protected by wmi_lock. */
+struct huawei_wmi_resp {
+	u8 buf[HWMI_RESP_SIZE] __aligned(sizeof(u64));
+	u64 reused;
+	u64 allocs;
+};
+
 struct huawei_wmi {
 	bool battery_available;
 	bool fn_lock_available;
@@ -94,9 +571,34 @@ struct huawei_wmi {
 	bool temp_available;
 	bool smart_charge_available;
 	bool smart_charge_param_available;
+	bool discovered;
+	struct work_struct discover;
+	atomic_t users;		/* event handlers, see huawei_wmi_get() */
+
+	const struct huawei_wmi_ops *ops;
+	struct wmi_device *wdev;	/* HWMI_METHOD_GUID, NULL for the fake */
+	struct huawei_wmi_fake fake;
 
 	struct huawei_wmi_debug debug;
-	struct input_dev *idev[2];
+	struct huawei_wmi_cache cache;
+	struct huawei_wmi_flights flights;
+	struct huawei_wmi_breaker breaker;
+	struct huawei_wmi_resp resp;
+	struct huawei_wmi_cmds cmds;
+	struct huawei_wmi_stats __percpu *stats;
+	struct huawei_wmi_caps caps;
+	struct huawei_wmi_snapshot snap;
+	struct huawei_wmi_recorder rec;
+	u64 lock_wait;
+	int shape;		/* HWMI_SHAPE_*, protected by wmi_lock */
+	u64 shape_fallbacks;
+	struct huawei_wmi_sched sched;
+	struct huawei_wmi_watchdog wdog;
+	struct huawei_wmi_util util;
+	struct huawei_wmi_lockstat lockstat;
+	int user;		/* HWMI_FEAT_* of the wmi_lock holder, if known */
+	int prio;		/* HWMI_PRIO_* of the wmi_lock holder */
+	struct huawei_wmi_async async;
 	struct led_classdev micmute_cdev;
 	struct led_classdev kbdlight_cdev;
 	struct device *dev;
@@ -105,7 +607,50 @@ struct huawei_wmi {
 	struct mutex wmi_lock;
 };
 
-static struct huawei_wmi *huawei_wmi;
+/* What a bound WMI GUID is used for */
+enum {
+	HWMI_ROLE_METHOD,
+	HWMI_ROLE_EVENT,
+	HWMI_ROLE_WMI0,
+};
+
+/* Per WMI device state. The method and event GUIDs bind independently. */
+struct huawei_wmi_wdev {
+	int role;
+	struct platform_device *pdev;	/* HWMI_ROLE_METHOD */
+	struct input_dev *idev;		/* HWMI_ROLE_EVENT */
+};
+
+/* Event handlers and the battery hook get no handle of the method side
+ * instance, they look it up here. Protected by huawei_wmi_link_lock. The
+ * battery attributes read huawei_wmi_method without it, the hook is only
+ * registered while it's set.
+ */
+static DEFINE_MUTEX(huawei_wmi_link_lock);
+static struct huawei_wmi *huawei_wmi_method;
+static struct wmi_device *huawei_wmi_wmi0;
+
+/* Pins the method side instance for an event handler, so it can talk to the
+ * EC without holding huawei_wmi_link_lock. Remove waits for the last put.
+ */
+static struct huawei_wmi *huawei_wmi_get(void)
+{
+	struct huawei_wmi *huawei;
+
+	mutex_lock(&huawei_wmi_link_lock);
+	huawei = huawei_wmi_method;
+	if (huawei)
+		atomic_inc(&huawei->users);
+	mutex_unlock(&huawei_wmi_link_lock);
+
+	return huawei;
+}
+
+static void huawei_wmi_put(struct huawei_wmi *huawei)
+{
+	if (atomic_dec_and_test(&huawei->users))
+		wake_up_var(&huawei->users);
+}
 
 enum {
 	KBDLIGHT_KEY_0 = 0x293,
@@ -172,6 +717,15 @@ static int report_brightness = -1;
 static int report_volume = -1;
 static int handle_kbdlight = -1;
 static int kbdlight_auto = -1;
+static bool async_write;
+static char *backend = "wmi";
+
+/* All deferred work runs here. Unbound and exposed in sysfs, so its CPUs
+ * can be set in /sys/devices/virtual/workqueue/huawei-wmi/cpumask to keep
+ * EC work off isolated cores.
+ */
+static struct workqueue_struct *huawei_wmi_wq;
+static unsigned int record;
 
 module_param(battery_reset, bint, 0444);
 MODULE_PARM_DESC(battery_reset,
@@ -188,6 +742,15 @@ MODULE_PARM_DESC(handle_kbdlight,
 module_param(kbdlight_auto, bint, 0444);
 MODULE_PARM_DESC(kbdlight_auto,
 		"Keyboard backlight supports the auto mode.");
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend,
+		"HWMI backend, \"wmi\" (default) or \"fake\" for an in-kernel EC model.");
+module_param(async_write, bool, 0644);
+MODULE_PARM_DESC(async_write,
+		"Apply sysfs writes in the background, coalescing pending ones.");
+module_param(record, uint, 0444);
+MODULE_PARM_DESC(record,
+		"Number of commands the debugfs recorder keeps, 0 (default) disables it.");
 
 /* Quirks */
 
@@ -304,1071 +867,3141 @@ static const struct dmi_system_id huawei_quirks[] = {
 	{  }
 };
 
-/* Utils */
+/* Backends */
 
-static int huawei_wmi_call(struct huawei_wmi *huawei,
-			   struct acpi_buffer *in, struct acpi_buffer *out)
+static bool huawei_wmi_wmi_present(struct huawei_wmi *huawei)
 {
-	acpi_status status;
-
-	mutex_lock(&huawei->wmi_lock);
-	status = wmi_evaluate_method(HWMI_METHOD_GUID, 0, 1, in, out);
-	mutex_unlock(&huawei->wmi_lock);
-	if (ACPI_FAILURE(status)) {
-		dev_err(huawei->dev, "Failed to evaluate wmi method\n");
-		return -ENODEV;
-	}
-
-	return 0;
+	return huawei->wdev;
 }
 
-/* HWMI takes a 64 bit input and returns either a package with 2 buffers, one of
- * 4 bytes and the other of 256 bytes, or one buffer of size 0x104 (260) bytes.
- * The first 4 bytes are ignored, we ignore the first 4 bytes buffer if we got a
- * package, or skip the first 4 if a buffer of 0x104 is used. The first byte of
- * the remaining 0x100 sized buffer has the return status of every call. In case
- * the return status is non-zero, we return -ENODEV but still copy the returned
- * buffer to the given buffer parameter (buf).
- */
-static int huawei_wmi_cmd(u64 arg, u8 *buf, size_t buflen)
+static acpi_status huawei_wmi_wmi_evaluate(struct huawei_wmi *huawei,
+		const struct acpi_buffer *in, struct acpi_buffer *out)
 {
-	struct huawei_wmi *huawei = huawei_wmi;
-	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
-	struct acpi_buffer in;
-	union acpi_object *obj;
-	size_t len;
-	int err, i;
+	return wmidev_evaluate_method(huawei->wdev, 0, 1, in, out);
+}
 
-	in.length = sizeof(arg);
-	in.pointer = &arg;
+static const struct huawei_wmi_ops huawei_wmi_wmi_ops = {
+	.name = "wmi",
+	.present = huawei_wmi_wmi_present,
+	.evaluate = huawei_wmi_wmi_evaluate,
+};
 
-	/* Some models require calling HWMI twice to execute a command. We evaluate
-	 * HWMI and if we get a non-zero return status we evaluate it again.
-	 */
-	for (i = 0; i < 2; i++) {
-		err = huawei_wmi_call(huawei, &in, &out);
-		if (err)
-			goto fail_cmd;
+static void huawei_wmi_fake_init(struct huawei_wmi_fake *fake)
+{
+	int i;
 
-		obj = out.pointer;
-		if (!obj) {
-			err = -EIO;
-			goto fail_cmd;
+	fake->shape = HWMI_SHAPE_PACKAGE;
+	fake->battery[0] = 0;
+	fake->battery[1] = 100;
+	fake->fn_lock = 1;		// off
+	fake->kbdlight = 1 << 3;	// level 1
+	fake->kbdlight_timeout = 30;
+	fake->fans = 1;
+	fake->fan_rpm[0] = 2400;
+	for (i = 0; i < ARRAY_SIZE(fake->temp); i++)
+		fake->temp[i] = 40 + i;
+}
+
+/* Looks the command up in the loaded recording, starting where the last
+ * match left off so repeated commands are answered in recorded order.
+ */
+static const struct hwmi_rec *huawei_wmi_fake_replay_find(
+		struct huawei_wmi_fake *fake, u64 arg)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < fake->replay_count; i++) {
+		n = (fake->replay_cursor + i) % fake->replay_count;
+		if (le64_to_cpu(fake->replay[n].arg) == arg) {
+			fake->replay_cursor = n + 1;
+			fake->replayed++;
+			return &fake->replay[n];
 		}
+	}
 
-		switch (obj->type) {
-		/* Models that implement both "legacy" and HWMI tend to return a 0x104
-		 * sized buffer instead of a package of 0x4 and 0x100 buffers.
-		 */
-		case ACPI_TYPE_BUFFER:
-			if (obj->buffer.length == 0x104) {
-				// Skip the first 4 bytes.
-				obj->buffer.pointer += 4;
-				len = HWMI_BUFF_SIZE;
-			} else {
-				dev_err(huawei->dev, "Bad buffer length, got %d\n", obj->buffer.length);
-				err = -EIO;
-				goto fail_cmd;
-			}
+	return NULL;
+}
 
-			break;
-		/* HWMI returns a package with 2 buffer elements, one of 4 bytes and the
-		 * other is 256 bytes.
-		 */
-		case ACPI_TYPE_PACKAGE:
-			if (obj->package.count != 2) {
-				dev_err(huawei->dev, "Bad package count, got %d\n", obj->package.count);
-				err = -EIO;
-				goto fail_cmd;
-			}
+/* Runs one command against the modelled EC state and fills the 256 bytes
+ * response, the first byte being the return status.
+ */
+static void huawei_wmi_fake_cmd(struct huawei_wmi_fake *fake,
+		const union hwmi_arg *arg, u8 *ret)
+{
+	u16 cmd = arg->cmd & 0xffff;
 
-			obj = &obj->package.elements[1];
-			if (obj->type != ACPI_TYPE_BUFFER) {
-				dev_err(huawei->dev, "Bad package element type, got %d\n", obj->type);
-				err = -EIO;
-				goto fail_cmd;
-			}
-			len = obj->buffer.length;
+	fake->evals++;
+
+	if ((fake->err_cmd && fake->err_cmd == cmd) ||
+			(fake->err_every && !(fake->evals % fake->err_every)) ||
+			(fake->retry_quirk && fake->last_arg != arg->cmd)) {
+		fake->last_arg = arg->cmd;
+		ret[0] = 1;
+		return;
+	}
+	fake->last_arg = arg->cmd;
 
+	switch (cmd) {
+	case BATTERY_THRESH_GET:
+		ret[1] = fake->battery[0];
+		ret[2] = fake->battery[1];
+		break;
+	case BATTERY_THRESH_SET:
+		fake->battery[0] = arg->args[2];
+		fake->battery[1] = arg->args[3];
+		break;
+	case BATTERY_CHARGE_MODE_GET:
+		memcpy(&ret[1], fake->charge_mode, sizeof(fake->charge_mode));
+		break;
+	case BATTERY_CHARGE_MODE_SET:
+		memcpy(fake->charge_mode, &arg->args[2], sizeof(fake->charge_mode));
+		break;
+	case BATTERY_CHARGE_MODE_PARAM_GET:
+		ret[1] = fake->charge_param;
+		break;
+	case BATTERY_CHARGE_MODE_PARAM_SET:
+		fake->charge_param = arg->args[2];
+		break;
+	case FN_LOCK_GET:
+		ret[1] = fake->fn_lock;
+		break;
+	case FN_LOCK_SET:
+		fake->fn_lock = arg->args[2];
+		break;
+	case KBDLIGHT_GET:
+		ret[2] = fake->kbdlight;
+		break;
+	case KBDLIGHT_SET:
+		fake->kbdlight = arg->args[2];
+		break;
+	case KBDLIGHT_MODE_GET:
+		ret[1] = fake->kbdlight_mode;
+		break;
+	case KBDLIGHT_MODE_SET:
+		fake->kbdlight_mode = arg->args[2];
+		break;
+	case KBDLIGHT_SET_AUTO:
+		fake->kbdlight_auto = arg->args[2];
+		break;
+	case KBDLIGHT_TIMEOUT_GET:
+		ret[1] = fake->kbdlight_timeout & 0xff;
+		ret[2] = fake->kbdlight_timeout >> 8;
+		break;
+	case KBDLIGHT_TIMEOUT_SET:
+		fake->kbdlight_timeout = arg->args[2] | (arg->args[3] << 8);
+		break;
+	case POWER_UNLOCK_GET:
+		ret[1] = fake->power_unlock;
+		break;
+	case POWER_UNLOCK_SET:
+		fake->power_unlock = arg->args[2];
+		break;
+	case MICMUTE_LED_SET:
+		fake->micmute = arg->args[2];
+		break;
+	case TOUCHPAD_GET:
+		ret[1] = fake->touchpad;
+		break;
+	case TOUCHPAD_SET:
+		fake->touchpad = arg->args[2];
+		break;
+	case FAN_SPEED_GET:
+		if (arg->args[2] >= fake->fans ||
+				arg->args[2] >= ARRAY_SIZE(fake->fan_rpm)) {
+			ret[0] = 1;
 			break;
-		/* Shouldn't get here! */
-		default:
-			dev_err(huawei->dev, "Unexpected obj type, got: %d\n", obj->type);
-			err = -EIO;
-			goto fail_cmd;
 		}
-
-		if (!*obj->buffer.pointer)
+		ret[1] = fake->fan_rpm[arg->args[2]] & 0xff;
+		ret[2] = fake->fan_rpm[arg->args[2]] >> 8;
+		break;
+	case TEMP_GET:
+		if (arg->args[2] >= ARRAY_SIZE(fake->temp)) {
+			ret[0] = 1;
 			break;
+		}
+		ret[2] = fake->temp[arg->args[2]];
+		break;
+	default:
+		ret[0] = 1;
+		break;
 	}
+}
+
+/* Builds the same ACPI objects as the firmware does, either a 0x104 bytes
+ * buffer or a package of a 4 and a 256 bytes buffers, following the usual
+ * acpi_buffer rules for caller provided and ACPI_ALLOCATE_BUFFER buffers.
+ */
+static acpi_status huawei_wmi_fake_evaluate(struct huawei_wmi *huawei,
+		const struct acpi_buffer *in, struct acpi_buffer *out)
+{
+	struct huawei_wmi_fake *fake = &huawei->fake;
+	u8 ret[HWMI_BUFF_SIZE] = { 0 };
+	const struct hwmi_rec *rec;
+	union acpi_object *obj;
+	union hwmi_arg arg;
+	size_t size;
+	u8 *data;
+
+	if (in->length != sizeof(arg.cmd))
+		return AE_BAD_PARAMETER;
+	memcpy(&arg.cmd, in->pointer, sizeof(arg.cmd));
+
+	rec = huawei_wmi_fake_replay_find(fake, arg.cmd);
+	if (rec) {
+		fsleep(div_u64(le64_to_cpu(rec->duration), NSEC_PER_USEC));
+		if (!rec->len)
+			return AE_ERROR;
+		memcpy(ret, rec->resp, min_t(u8, rec->len, HWMI_REC_RESP));
+	} else {
+		if (fake->latency_us)
+			fsleep(fake->latency_us);
 
-	err = (*obj->buffer.pointer) ? -ENODEV : 0;
+		huawei_wmi_fake_cmd(fake, &arg, ret);
+	}
 
-	if (buf) {
-		len = min(buflen, len);
-		memcpy(buf, obj->buffer.pointer, len);
+	if (fake->shape == HWMI_SHAPE_BUFFER)
+		size = sizeof(*obj) + ACPI_ROUND_UP_TO_NATIVE_WORD(HWMI_BUFF_SIZE + 4);
+	else
+		size = 3 * sizeof(*obj) + ACPI_ROUND_UP_TO_NATIVE_WORD(4) +
+			ACPI_ROUND_UP_TO_NATIVE_WORD(HWMI_BUFF_SIZE);
+
+	if (out->length == ACPI_ALLOCATE_BUFFER) {
+		out->pointer = kzalloc(size, GFP_KERNEL);
+		if (!out->pointer)
+			return AE_NO_MEMORY;
+	} else if (out->length < size) {
+		out->length = size;
+		return AE_BUFFER_OVERFLOW;
+	} else {
+		memset(out->pointer, 0, size);
+	}
+	out->length = size;
+
+	obj = out->pointer;
+	if (fake->shape == HWMI_SHAPE_BUFFER) {
+		data = (u8 *)&obj[1];
+		obj->type = ACPI_TYPE_BUFFER;
+		obj->buffer.length = HWMI_BUFF_SIZE + 4;
+		obj->buffer.pointer = data;
+		memcpy(data + 4, ret, HWMI_BUFF_SIZE);
+	} else {
+		data = (u8 *)&obj[3];
+		obj[0].type = ACPI_TYPE_PACKAGE;
+		obj[0].package.count = 2;
+		obj[0].package.elements = &obj[1];
+		obj[1].type = ACPI_TYPE_BUFFER;
+		obj[1].buffer.length = 4;
+		obj[1].buffer.pointer = data;
+		obj[2].type = ACPI_TYPE_BUFFER;
+		obj[2].buffer.length = HWMI_BUFF_SIZE;
+		obj[2].buffer.pointer = data + ACPI_ROUND_UP_TO_NATIVE_WORD(4);
+		memcpy(obj[2].buffer.pointer, ret, HWMI_BUFF_SIZE);
 	}
 
-fail_cmd:
-	kfree(out.pointer);
-	return err;
+	return AE_OK;
 }
 
-/* LEDs */
-
-static int huawei_wmi_micmute_led_set(struct led_classdev *led_cdev,
-		enum led_brightness brightness)
+static bool huawei_wmi_fake_present(struct huawei_wmi *huawei)
 {
-	/* This is a workaround until the "legacy" interface is implemented. */
-	if (quirks && quirks->ec_micmute) {
-		char *acpi_method;
-		acpi_handle handle;
-		acpi_status status;
-		union acpi_object args[3];
-		struct acpi_object_list arg_list = {
-			.pointer = args,
-			.count = ARRAY_SIZE(args),
-		};
+	return true;
+}
 
-		handle = ec_get_handle();
-		if (!handle)
-			return -ENODEV;
+static const struct huawei_wmi_ops huawei_wmi_fake_ops = {
+	.name = "fake",
+	.present = huawei_wmi_fake_present,
+	.evaluate = huawei_wmi_fake_evaluate,
+};
 
-		args[0].type = args[1].type = args[2].type = ACPI_TYPE_INTEGER;
-		args[1].integer.value = 0x04;
+/* Utils */
 
-		if (acpi_has_method(handle, "SPIN")) {
-			acpi_method = "SPIN";
-			args[0].integer.value = 0;
-			args[2].integer.value = brightness ? 1 : 0;
-		} else if (acpi_has_method(handle, "WPIN")) {
-			acpi_method = "WPIN";
-			args[0].integer.value = 1;
-			args[2].integer.value = brightness ? 0 : 1;
-		} else {
-			return -ENODEV;
-		}
-
-		status = acpi_evaluate_object(handle, acpi_method, &arg_list, NULL);
-		if (ACPI_FAILURE(status))
-			return -ENODEV;
+static const char * const hwmi_prio_names[] = {
+	[HWMI_PRIO_INTERACTIVE] = "interactive",
+	[HWMI_PRIO_CONTROL] = "control",
+	[HWMI_PRIO_BACKGROUND] = "background",
+};
 
-		return 0;
-	} else {
-		union hwmi_arg arg;
+/* Caller must hold sched->lock. */
+static bool huawei_wmi_sched_ready(struct huawei_wmi_sched *sched, int prio)
+{
+	int i;
 
-		arg.cmd = MICMUTE_LED_SET;
-		arg.args[2] = brightness;
+	if (sched->busy)
+		return false;
 
-		return huawei_wmi_cmd(arg.cmd, NULL, 0);
+	for (i = 0; i < prio; i++) {
+		if (sched->waiting[i])
+			return false;
 	}
-}
-
-static int huawei_wmi_kbdlight_set_auto(int level);
 
-static int huawei_wmi_kbdlight_led_set(struct led_classdev *led_cdev,
-		enum led_brightness brightness)
-{
-	return huawei_wmi_kbdlight_set_auto(brightness);
+	return true;
 }
 
-static void huawei_wmi_leds_setup(struct device *dev)
+static bool huawei_wmi_sched_try(struct huawei_wmi_sched *sched, int prio)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	bool ready;
 
-	huawei->micmute_cdev.name = "huawei::micmute";
-	huawei->micmute_cdev.max_brightness = 1;
-	huawei->micmute_cdev.brightness_set_blocking = &huawei_wmi_micmute_led_set;
-	huawei->micmute_cdev.default_trigger = "audio-micmute";
-	huawei->micmute_cdev.dev = dev;
-	huawei->micmute_cdev.flags = LED_CORE_SUSPENDRESUME;
+	spin_lock(&sched->lock);
+	ready = huawei_wmi_sched_ready(sched, prio);
+	if (ready) {
+		sched->waiting[prio]--;
+		sched->busy = true;
+	}
+	spin_unlock(&sched->lock);
 
-	if (acpi_has_method(NULL, "\\SMLS") || (quirks && quirks->ec_micmute))
-		devm_led_classdev_register(dev, &huawei->micmute_cdev);
+	return ready;
+}
 
-	huawei->kbdlight_cdev.name = "huawei::kbd_backlight";
-	huawei->kbdlight_cdev.max_brightness = 100;
-	huawei->kbdlight_cdev.brightness_set_blocking = &huawei_wmi_kbdlight_led_set;
-	huawei->kbdlight_cdev.dev = dev;
+/* Whether the evaluation in progress has been running for longer than
+ * slow_ms.
+ */
+static bool huawei_wmi_stalled(struct huawei_wmi *huawei)
+{
+	struct huawei_wmi_watchdog *wdog = &huawei->wdog;
+	bool stalled;
 
-	if (acpi_has_method(NULL, "\\SKBL") || (quirks && quirks->kbdlight_auto))
-		devm_led_classdev_register(dev, &huawei->kbdlight_cdev);
-}
+	spin_lock(&wdog->lock);
+	stalled = wdog->slow_ms && wdog->start && ktime_get_ns() - wdog->start >
+		(u64)wdog->slow_ms * NSEC_PER_MSEC;
+	spin_unlock(&wdog->lock);
 
-/* Battery protection */
+	return stalled;
+}
 
-static int huawei_wmi_battery_get(int *start, int *end)
+/* wmi_lock helpers. Waiters are let in by priority class: a hotkey doesn't
+ * queue up behind a burst of sensor reads. They remember how long we waited
+ * for the lock so the first command evaluated under it can account for it.
+ *
+ * With a timeout_ms, returns -EBUSY right away if the current evaluation is
+ * stalled and -ETIMEDOUT if we didn't get the lock in time.
+ */
+static int huawei_wmi_lock(struct huawei_wmi *huawei, int prio,
+		unsigned int timeout_ms)
 {
-	u8 ret[HWMI_BUFF_SIZE];
-	int err, i;
+	struct huawei_wmi_sched *sched = &huawei->sched;
+	struct huawei_wmi_sched_stats *stats = &sched->stats[prio];
+	u64 start = ktime_get_ns();
+	bool contended;
+	u64 wait;
+
+	if (timeout_ms && huawei_wmi_stalled(huawei)) {
+		spin_lock(&huawei->wdog.lock);
+		huawei->wdog.busy++;
+		spin_unlock(&huawei->wdog.lock);
+		return -EBUSY;
+	}
 
-	err = huawei_wmi_cmd(BATTERY_THRESH_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+	spin_lock(&sched->lock);
+	sched->waiting[prio]++;
+	spin_unlock(&sched->lock);
+
+	contended = !huawei_wmi_sched_try(sched, prio);
+	if (contended && !timeout_ms) {
+		wait_event(sched->wq, huawei_wmi_sched_try(sched, prio));
+	} else if (contended && !wait_event_timeout(sched->wq,
+			huawei_wmi_sched_try(sched, prio),
+			msecs_to_jiffies(timeout_ms))) {
+		spin_lock(&sched->lock);
+		sched->waiting[prio]--;
+		stats->timeouts++;
+		spin_unlock(&sched->lock);
+
+		/* Lower classes might have been waiting for us. */
+		wake_up_all(&sched->wq);
+		return -ETIMEDOUT;
+	}
 
-	/* Find the last two non-zero values. Return status is ignored. */
-	i = 0xff;
-	do {
-		if (start)
-			*start = ret[i-1];
-		if (end)
-			*end = ret[i];
-	} while (i > 2 && !ret[i--]);
+	/* Debugfs readers take the mutex without going through the classes. */
+	if (!mutex_trylock(&huawei->wmi_lock)) {
+		contended = true;
+		mutex_lock(&huawei->wmi_lock);
+	}
+	huawei->lockstat.acquired = ktime_get_ns();
+	wait = huawei->lockstat.acquired - start;
+	huawei->lockstat.wait = wait;
+	huawei->lockstat.contended = contended;
+	huawei->lockstat.feat_cur = HWMI_FEAT_NONE;
+	huawei->lock_wait = wait;
+	huawei->user = prio == HWMI_PRIO_INTERACTIVE ?
+		HWMI_FEAT_INPUT : HWMI_FEAT_NONE;
+	huawei->prio = prio;
+
+	spin_lock(&sched->lock);
+	stats->count++;
+	stats->wait_sum += wait;
+	stats->wait_max = max(stats->wait_max, wait);
+	spin_unlock(&sched->lock);
 
 	return 0;
 }
 
-static int huawei_wmi_battery_set(int start, int end)
+static void huawei_wmi_unlock(struct huawei_wmi *huawei)
 {
-	union hwmi_arg arg;
-	int err;
+	struct huawei_wmi_sched *sched = &huawei->sched;
+	struct huawei_wmi_lockstat *ls = &huawei->lockstat;
+	struct huawei_wmi_lockstat_feat *stat;
+	u64 hold = ktime_get_ns() - ls->acquired;
+	u64 wait = ls->wait;
+	bool contended = ls->contended;
+	int feat = ls->feat_cur;
+
+	/* No command went through __huawei_wmi_cmd_decode(), a debugfs call. */
+	if (feat == HWMI_FEAT_NONE)
+		feat = huawei->user != HWMI_FEAT_NONE ?
+			huawei->user : HWMI_FEAT_OTHER;
+
+	huawei->lock_wait = 0;
+	mutex_unlock(&huawei->wmi_lock);
 
-	if (start < 0 || end < 0 || start > 100 || end > 100)
-		return -EINVAL;
+	spin_lock(&ls->lock);
+	stat = &ls->feat[feat];
+	stat->acquired++;
+	if (contended)
+		stat->contended++;
+	stat->wait_sum += wait;
+	stat->wait_max = max(stat->wait_max, wait);
+	stat->hold_sum += hold;
+	stat->hold_max = max(stat->hold_max, hold);
+	spin_unlock(&ls->lock);
+
+	spin_lock(&sched->lock);
+	sched->busy = false;
+	spin_unlock(&sched->lock);
+
+	wake_up_all(&sched->wq);
+}
 
-	arg.cmd = BATTERY_THRESH_SET;
-	arg.args[2] = start;
-	arg.args[3] = end;
+/* For raw calls and debugfs writers, charged to debugfs. */
+static void huawei_wmi_debugfs_lock(struct huawei_wmi *huawei)
+{
+	huawei_wmi_lock(huawei, HWMI_PRIO_CONTROL, 0);
+	huawei->user = HWMI_FEAT_DEBUGFS;
+}
 
-	/* This is an edge case were some models turn battery protection
-	 * off without changing their thresholds values. We clear the
-	 * values before turning off protection. Sometimes we need a sleep delay to
-	 * make sure these values make their way to EC memory.
-	 */
-	if (quirks && quirks->battery_reset && start == 0 && end == 100) {
-		err = huawei_wmi_battery_set(0, 0);
-		if (err)
-			return err;
+static void huawei_wmi_watchdog_start(struct huawei_wmi *huawei,
+		const struct acpi_buffer *in)
+{
+	struct huawei_wmi_watchdog *wdog = &huawei->wdog;
+
+	spin_lock(&wdog->lock);
+	wdog->cur.arg = in->length >= sizeof(u64) ? *(u64 *)in->pointer : 0;
+	wdog->cur.pid = task_pid_nr(current);
+	get_task_comm(wdog->cur.comm, current);
+	wdog->start = ktime_get_ns();
+	spin_unlock(&wdog->lock);
+}
 
-		msleep(1000);
+/* Counts and logs the evaluation that just finished if it was slow. Returns
+ * its duration.
+ */
+static u64 huawei_wmi_watchdog_stop(struct huawei_wmi *huawei)
+{
+	struct huawei_wmi_watchdog *wdog = &huawei->wdog;
+	struct huawei_wmi_slow *slow;
+	u64 duration, arg;
+
+	spin_lock(&wdog->lock);
+	arg = wdog->cur.arg;
+	duration = ktime_get_ns() - wdog->start;
+	wdog->start = 0;
+	if (!wdog->slow_ms || duration <= (u64)wdog->slow_ms * NSEC_PER_MSEC) {
+		spin_unlock(&wdog->lock);
+		return duration;
 	}
 
-	err = huawei_wmi_cmd(arg.cmd, NULL, 0);
+	wdog->slow++;
+	slow = &wdog->log[wdog->next++ % HWMI_SLOW_LOG];
+	*slow = wdog->cur;
+	slow->duration = duration;
+	spin_unlock(&wdog->lock);
 
-	return err;
+	dev_warn_ratelimited(huawei->dev, "Command 0x%04llx took %llu ms\n",
+			arg & 0xffff, div_u64(duration, NSEC_PER_MSEC));
+
+	return duration;
 }
 
-static ssize_t charge_control_start_threshold_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+static int huawei_wmi_feature(struct huawei_wmi *huawei, u64 arg)
 {
-	int err, start;
-
-	err = huawei_wmi_battery_get(&start, NULL);
-	if (err)
-		return err;
+	if (huawei->user != HWMI_FEAT_NONE)
+		return huawei->user;
+
+	switch (arg & 0xffff) {
+	case BATTERY_THRESH_GET:
+	case BATTERY_THRESH_SET:
+	case BATTERY_CHARGE_MODE_GET:
+	case BATTERY_CHARGE_MODE_SET:
+	case BATTERY_CHARGE_MODE_PARAM_GET:
+	case BATTERY_CHARGE_MODE_PARAM_SET:
+	case POWER_UNLOCK_GET:
+	case POWER_UNLOCK_SET:
+		return HWMI_FEAT_BATTERY;
+	case FAN_SPEED_GET:
+	case TEMP_GET:
+		return HWMI_FEAT_HWMON;
+	case KBDLIGHT_GET:
+	case KBDLIGHT_SET:
+	case KBDLIGHT_TIMEOUT_GET:
+	case KBDLIGHT_TIMEOUT_SET:
+	case KBDLIGHT_MODE_GET:
+	case KBDLIGHT_MODE_SET:
+	case KBDLIGHT_SET_AUTO:
+		return HWMI_FEAT_KBDLIGHT;
+	default:
+		return HWMI_FEAT_OTHER;
+	}
+}
 
-	return sprintf(buf, "%d\n", start);
+/* Charges an evaluation of duration ns to the feature that issued it. Caller
+ * must hold wmi_lock.
+ */
+static void huawei_wmi_util_account(struct huawei_wmi *huawei, u64 duration)
+{
+	struct huawei_wmi_util *util = &huawei->util;
+	struct huawei_wmi_util_bucket *bucket;
+	u64 sec = div_u64(ktime_get_ns(), NSEC_PER_SEC);
+	int feat = huawei_wmi_feature(huawei, huawei->wdog.cur.arg);
+
+	spin_lock(&util->lock);
+	util->busy[feat] += duration;
+	util->calls[feat]++;
+
+	bucket = &util->buckets[feat][sec % (HWMI_UTIL_SECS + 1)];
+	if (bucket->sec != sec) {
+		bucket->sec = sec;
+		bucket->busy = 0;
+		bucket->calls = 0;
+	}
+	bucket->busy += duration;
+	bucket->calls++;
+	spin_unlock(&util->lock);
 }
 
-static ssize_t charge_control_end_threshold_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+/* Caller must hold wmi_lock. */
+static int __huawei_wmi_call(struct huawei_wmi *huawei,
+			     struct acpi_buffer *in, struct acpi_buffer *out)
 {
-	int err, end;
+	acpi_status status;
 
-	err = huawei_wmi_battery_get(NULL, &end);
-	if (err)
-		return err;
+	lockdep_assert_held(&huawei->wmi_lock);
 
-	return sprintf(buf, "%d\n", end);
+	huawei_wmi_watchdog_start(huawei, in);
+	status = huawei->ops->evaluate(huawei, in, out);
+	huawei_wmi_util_account(huawei, huawei_wmi_watchdog_stop(huawei));
+	if (status == AE_BUFFER_OVERFLOW)
+		return -ENOSPC;
+	if (ACPI_FAILURE(status)) {
+		dev_err_ratelimited(huawei->dev, "Failed to evaluate wmi method\n");
+		return -ENODEV;
+	}
+
+	return 0;
 }
 
-static ssize_t charge_control_thresholds_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+static int huawei_wmi_call(struct huawei_wmi *huawei,
+			   struct acpi_buffer *in, struct acpi_buffer *out)
 {
-	int err, start, end;
+	int err;
 
-	err = huawei_wmi_battery_get(&start, &end);
-	if (err)
-		return err;
+	huawei_wmi_debugfs_lock(huawei);
+	err = __huawei_wmi_call(huawei, in, out);
+	huawei_wmi_unlock(huawei);
 
-	return sprintf(buf, "%d %d\n", start, end);
+	return err;
 }
 
-static ssize_t charge_control_start_threshold_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+/* Evaluates HWMI into the preallocated response buffer. If the firmware ever
+ * returns more than HWMI_RESP_SIZE, a GET is evaluated again into an ACPI
+ * allocated buffer. A SET isn't, the firmware would act on it twice. Caller
+ * must hold wmi_lock and release out with huawei_wmi_resp_put().
+ */
+static int huawei_wmi_resp_eval(struct huawei_wmi *huawei,
+		struct acpi_buffer *in, struct acpi_buffer *out, bool get)
 {
-	int err, start, end;
+	int err;
 
-	err = huawei_wmi_battery_get(NULL, &end);
-	if (err)
+	out->length = sizeof(huawei->resp.buf);
+	out->pointer = huawei->resp.buf;
+
+	err = __huawei_wmi_call(huawei, in, out);
+	if (err != -ENOSPC) {
+		if (!err)
+			huawei->resp.reused++;
 		return err;
+	}
 
-	if (sscanf(buf, "%d", &start) != 1)
-		return -EINVAL;
+	dev_warn_once(huawei->dev, "Response of %zu bytes exceeds the preallocated buffer\n",
+			(size_t)out->length);
 
-	err = huawei_wmi_battery_set(start, end);
-	if (err)
-		return err;
+	if (!get)
+		return -EIO;
 
-	return size;
+	huawei->resp.allocs++;
+	out->length = ACPI_ALLOCATE_BUFFER;
+	out->pointer = NULL;
+
+	return __huawei_wmi_call(huawei, in, out);
 }
 
-static ssize_t charge_control_end_threshold_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+static void huawei_wmi_resp_put(struct huawei_wmi *huawei,
+		struct acpi_buffer *out)
 {
-	int err, start, end;
+	if (out->pointer != huawei->resp.buf)
+		kfree(out->pointer);
+	out->pointer = NULL;
+}
 
-	err = huawei_wmi_battery_get(&start, NULL);
-	if (err)
-		return err;
+/* Per-command state */
 
-	if (sscanf(buf, "%d", &end) != 1)
-		return -EINVAL;
+static int huawei_wmi_stat_index(u64 arg)
+{
+	u16 cmd = arg & 0xffff;
+	int i;
 
-	err = huawei_wmi_battery_set(start, end);
-	if (err)
-		return err;
+	for (i = 0; i < ARRAY_SIZE(hwmi_cmd_names); i++) {
+		if (hwmi_cmd_names[i].cmd == cmd)
+			return i;
+	}
 
-	return size;
+	return ARRAY_SIZE(hwmi_cmd_names);
 }
 
-static ssize_t charge_control_thresholds_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+static inline void huawei_wmi_stat_add(struct huawei_wmi *huawei, u64 arg,
+		int stat, u64 n)
 {
-	int err, start, end;
-
-	if (sscanf(buf, "%d %d", &start, &end) != 2)
-		return -EINVAL;
+	this_cpu_add(huawei->stats->count[huawei_wmi_stat_index(arg)][stat], n);
+}
 
-	err = huawei_wmi_battery_set(start, end);
-	if (err)
-		return err;
+static const char * const hwmi_cap_names[] = {
+	[HWMI_CAP_SMLS] = "\\SMLS",
+	[HWMI_CAP_SKBL] = "\\SKBL",
+	[HWMI_CAP_SPIN] = "SPIN",
+	[HWMI_CAP_WPIN] = "WPIN",
+};
 
-	return size;
+static void huawei_wmi_caps_setup(struct huawei_wmi *huawei)
+{
+	struct huawei_wmi_caps *caps = &huawei->caps;
+
+	caps->ec = ec_get_handle();
+	if (acpi_has_method(NULL, "\\SMLS"))
+		caps->methods |= BIT(HWMI_CAP_SMLS);
+	if (acpi_has_method(NULL, "\\SKBL"))
+		caps->methods |= BIT(HWMI_CAP_SKBL);
+	if (caps->ec && acpi_has_method(caps->ec, "SPIN"))
+		caps->methods |= BIT(HWMI_CAP_SPIN);
+	if (caps->ec && acpi_has_method(caps->ec, "WPIN"))
+		caps->methods |= BIT(HWMI_CAP_WPIN);
 }
 
-static DEVICE_ATTR_RW(charge_control_start_threshold);
-static DEVICE_ATTR_RW(charge_control_end_threshold);
-static DEVICE_ATTR_RW(charge_control_thresholds);
+static inline bool huawei_wmi_has_method(struct huawei_wmi *huawei, int cap)
+{
+	return huawei->caps.methods & BIT(cap);
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
-static int huawei_wmi_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
-#else
-static int huawei_wmi_battery_add(struct power_supply *battery)
-#endif
+/* Caller must hold wmi_lock. */
+static struct huawei_wmi_caps_cmd *huawei_wmi_caps_find(
+		struct huawei_wmi_caps *caps, u64 arg)
 {
-	device_create_file(&battery->dev, &dev_attr_charge_control_start_threshold);
-	device_create_file(&battery->dev, &dev_attr_charge_control_end_threshold);
+	int i;
 
-	return 0;
+	for (i = 0; i < caps->count; i++) {
+		if (caps->cmds[i].arg == arg)
+			return &caps->cmds[i];
+	}
+
+	return NULL;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
-static int huawei_wmi_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
-#else
-static int huawei_wmi_battery_remove(struct power_supply *battery)
-#endif
+/* Caller must hold wmi_lock. */
+static bool huawei_wmi_cmd_missing(struct huawei_wmi *huawei, u64 arg)
 {
-	device_remove_file(&battery->dev, &dev_attr_charge_control_start_threshold);
-	device_remove_file(&battery->dev, &dev_attr_charge_control_end_threshold);
+	struct huawei_wmi_caps_cmd *cmd = huawei_wmi_caps_find(&huawei->caps, arg);
 
-	return 0;
+	return cmd && cmd->missing;
 }
 
-static struct acpi_battery_hook huawei_wmi_battery_hook = {
-	.add_battery = huawei_wmi_battery_add,
-	.remove_battery = huawei_wmi_battery_remove,
-	.name = "Huawei Battery Extension"
-};
+/* Discovery's own calls, as opposed to a user poking sysfs while it runs. */
+static inline bool huawei_wmi_discovering(struct huawei_wmi *huawei)
+{
+	return current_work() == &huawei->discover;
+}
 
-static void huawei_wmi_battery_setup(struct device *dev)
+/* Only a non-zero status seen by discovery counts. A command failing later
+ * is more likely the EC having a bad moment than the firmware lacking it, and
+ * a failed evaluation says nothing about the command at all.
+ *
+ * Caller must hold wmi_lock.
+ */
+static void huawei_wmi_cmd_probed(struct huawei_wmi *huawei, u64 arg, int err,
+		u8 status)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct huawei_wmi_caps *caps = &huawei->caps;
+	struct huawei_wmi_caps_cmd *cmd = huawei_wmi_caps_find(caps, arg);
 
-	huawei->battery_available = true;
-	if (huawei_wmi_battery_get(NULL, NULL)) {
-		huawei->battery_available = false;
+	if (cmd) {
+		if (!err)
+			cmd->missing = false;
 		return;
 	}
 
-	battery_hook_register(&huawei_wmi_battery_hook);
-	device_create_file(dev, &dev_attr_charge_control_thresholds);
+	if (!huawei_wmi_discovering(huawei) || caps->count == HWMI_CMD_SIZE)
+		return;
+	if (err && !(err == -ENODEV && status))
+		return;
+
+	cmd = &caps->cmds[caps->count++];
+	cmd->arg = arg;
+	cmd->missing = err;
 }
 
-static void huawei_wmi_battery_exit(struct device *dev)
+static void huawei_wmi_lat_record(struct huawei_wmi_lat *lat, u64 ns)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = us ? ilog2(us) : 0;
+
+	if (!lat->count || ns < lat->min)
+		lat->min = ns;
+	if (ns > lat->max)
+		lat->max = ns;
+	lat->sum += ns;
+	lat->count++;
+	lat->buckets[min(bucket, HWMI_LAT_BUCKETS - 1)]++;
+}
 
-	if (huawei->battery_available) {
-		battery_hook_unregister(&huawei_wmi_battery_hook);
-		device_remove_file(dev, &dev_attr_charge_control_thresholds);
+/* Caller must hold wmi_lock. Returns NULL if the table is full. */
+static struct huawei_wmi_cmd_entry *huawei_wmi_cmd_entry(
+		struct huawei_wmi *huawei, u16 cmd)
+{
+	struct huawei_wmi_cmds *cmds = &huawei->cmds;
+	struct huawei_wmi_cmd_entry *entry;
+	int i;
+
+	for (i = 0; i < cmds->count; i++) {
+		if (cmds->entries[i].cmd == cmd)
+			return &cmds->entries[i];
 	}
+
+	if (cmds->count == HWMI_CMD_SIZE)
+		return NULL;
+
+	entry = &cmds->entries[cmds->count++];
+	entry->cmd = cmd;
+	entry->mode = HWMI_RETRY_AUTO;
+
+	return entry;
 }
 
-/* Smart charge param*/
+/* Retry policy */
+
+/* Failures of the first evaluation, without a single successful retry, after
+ * which we stop evaluating a command twice.
+ */
+#define HWMI_RETRY_LEARN 4
+
+static const char * const hwmi_retry_modes[] = {
+	[HWMI_RETRY_AUTO] = "auto",
+	[HWMI_RETRY_ALWAYS] = "always",
+	[HWMI_RETRY_NEVER] = "never",
+};
 
-static int huawei_wmi_smart_charge_param_get(int *value)
+static bool huawei_wmi_retry_wanted(const struct huawei_wmi_cmd_entry *entry)
 {
-	u8 ret[HWMI_BUFF_SIZE];
-	int err;
+	if (!entry)
+		return true;
+
+	switch (entry->mode) {
+	case HWMI_RETRY_ALWAYS:
+		return true;
+	case HWMI_RETRY_NEVER:
+		return false;
+	default:
+		return entry->recovered || entry->failed < HWMI_RETRY_LEARN;
+	}
+}
 
-	err = huawei_wmi_cmd(BATTERY_CHARGE_MODE_PARAM_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+/* Decoders */
 
-	if (value)
-		*value = ret[1];
+struct hwmi_copy {
+	u8 *buf;
+	size_t len;
+};
 
-	return 0;
+static void huawei_wmi_decode_copy(const u8 *resp, size_t len, void *ctx)
+{
+	struct hwmi_copy *copy = ctx;
+
+	memcpy(copy->buf, resp, min(copy->len, len));
 }
 
-static int huawei_wmi_smart_charge_param_set(int value)
-{
-	union hwmi_arg arg;
-	int err;
+/* Response cache */
 
-	if (value < 0 || value > 2)
-		return -EINVAL;
+/* Every GET command is keyed by its full 64 bit argument (command code and
+ * argument bytes) and kept for ttl_ms. Any of the matching SET commands drops
+ * the cached responses of that GET. Sensors and values the firmware changes
+ * on its own, from hotkeys, aren't cached unless a TTL is set in debugfs.
+ */
+struct hwmi_cache_policy {
+	const char *name;
+	u16 get;
+	u16 set[3];
+	u32 ttl_ms;
+};
 
-	arg.cmd = BATTERY_CHARGE_MODE_PARAM_SET;
-	arg.args[2] = (u8) value;
+static struct hwmi_cache_policy hwmi_cache_policies[] = {
+	{ "battery_thresh", BATTERY_THRESH_GET,
+		{ BATTERY_THRESH_SET, BATTERY_CHARGE_MODE_SET }, 1000 },
+	{ "smart_charge", BATTERY_CHARGE_MODE_GET,
+		{ BATTERY_CHARGE_MODE_SET, BATTERY_THRESH_SET }, 1000 },
+	{ "smart_charge_param", BATTERY_CHARGE_MODE_PARAM_GET,
+		{ BATTERY_CHARGE_MODE_PARAM_SET }, 1000 },
+	{ "fn_lock", FN_LOCK_GET, { FN_LOCK_SET }, 0 },
+	{ "kbdlight", KBDLIGHT_GET,
+		{ KBDLIGHT_SET, KBDLIGHT_SET_AUTO, KBDLIGHT_MODE_SET }, 0 },
+	{ "kbdlight_timeout", KBDLIGHT_TIMEOUT_GET, { KBDLIGHT_TIMEOUT_SET }, 1000 },
+	{ "power_unlock", POWER_UNLOCK_GET, { POWER_UNLOCK_SET }, 0 },
+	{ "fan_speed", FAN_SPEED_GET, { }, 0 },
+	{ "temp", TEMP_GET, { }, 0 },
+};
 
-	err = huawei_wmi_cmd(arg.cmd, NULL, 0);
-	return err;
+static inline u16 huawei_wmi_cmd_code(u64 arg)
+{
+	return arg & 0xffff;
 }
 
-static ssize_t smart_charge_param_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+static struct hwmi_cache_policy *huawei_wmi_cache_policy(u64 arg)
 {
-	int err, value;
+	u16 cmd = huawei_wmi_cmd_code(arg);
+	int i;
 
-	err = huawei_wmi_smart_charge_param_get(&value);
-	if (err)
-		return err;
+	for (i = 0; i < ARRAY_SIZE(hwmi_cache_policies); i++) {
+		if (hwmi_cache_policies[i].get == cmd)
+			return &hwmi_cache_policies[i];
+	}
 
-	return sprintf(buf, "%d\n", value);
+	return NULL;
 }
 
-static ssize_t smart_charge_param_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+static bool huawei_wmi_cache_lookup(struct huawei_wmi *huawei, u64 arg,
+		hwmi_decode_t decode, void *ctx)
 {
-	int err, value;
+	struct huawei_wmi_cache *cache = &huawei->cache;
+	struct huawei_wmi_cache_entry *entry;
+	bool hit = false;
+	int i;
 
-	if (sscanf(buf, "%d", &value) != 1)
-		return -EINVAL;
+	spin_lock(&cache->lock);
+	for (i = 0; i < HWMI_CACHE_SIZE; i++) {
+		entry = &cache->entries[i];
+		if (!entry->valid || entry->arg != arg)
+			continue;
 
-	err = huawei_wmi_smart_charge_param_set(value);
-	if (err)
-		return err;
+		if (time_before(jiffies, entry->expires)) {
+			if (decode)
+				decode(entry->buf, HWMI_BUFF_SIZE, ctx);
+			hit = true;
+		} else {
+			entry->valid = false;
+		}
+		break;
+	}
 
-	return size;
+	if (hit)
+		cache->hits++;
+	spin_unlock(&cache->lock);
+
+	if (hit) {
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_CALLS, 1);
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_CACHE_HITS, 1);
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_OK, 1);
+	}
+
+	return hit;
 }
 
-static DEVICE_ATTR_RW(smart_charge_param);
+/* Accounts a miss that is about to be evaluated and returns the current
+ * generation for huawei_wmi_cache_store().
+ */
+static unsigned int huawei_wmi_cache_miss(struct huawei_wmi *huawei)
+{
+	unsigned int gen;
 
-static void huawei_wmi_smart_charge_param_setup(struct device *dev)
+	spin_lock(&huawei->cache.lock);
+	huawei->cache.misses++;
+	gen = huawei->cache.gen;
+	spin_unlock(&huawei->cache.lock);
+
+	return gen;
+}
+
+/* Responses are only stored if no SET was issued since the GET started (gen),
+ * otherwise we might cache a value that was already overwritten.
+ */
+static void huawei_wmi_cache_store(struct huawei_wmi *huawei,
+		const struct hwmi_cache_policy *policy, unsigned int gen,
+		u64 arg, const u8 *buf, size_t len)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct huawei_wmi_cache *cache = &huawei->cache;
+	struct huawei_wmi_cache_entry *entry, *victim = NULL;
+	int i;
 
-	huawei->smart_charge_param_available = true;
-	if (huawei_wmi_smart_charge_param_get(NULL)) {
-		huawei->smart_charge_param_available = false;
-		return;
+	spin_lock(&cache->lock);
+	if (cache->gen != gen)
+		goto out;
+
+	for (i = 0; i < HWMI_CACHE_SIZE; i++) {
+		entry = &cache->entries[i];
+		if (entry->valid && entry->arg == arg) {
+			victim = entry;
+			break;
+		}
+		if (!victim || (victim->valid && (!entry->valid ||
+				time_before(entry->expires, victim->expires))))
+			victim = entry;
 	}
 
-	device_create_file(dev, &dev_attr_smart_charge_param);
+	victim->arg = arg;
+	victim->expires = jiffies + msecs_to_jiffies(policy->ttl_ms);
+	victim->valid = true;
+	memset(victim->buf, 0, HWMI_BUFF_SIZE);
+	memcpy(victim->buf, buf, min_t(size_t, len, HWMI_BUFF_SIZE));
+
+out:
+	spin_unlock(&cache->lock);
 }
 
-static void huawei_wmi_smart_charge_param_exit(struct device *dev)
+static void huawei_wmi_cache_invalidate(struct huawei_wmi *huawei, u64 arg)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-
-	if (huawei->smart_charge_param_available) {
-		device_remove_file(dev, &dev_attr_smart_charge_param);
+	struct huawei_wmi_cache *cache = &huawei->cache;
+	u16 cmd = huawei_wmi_cmd_code(arg);
+	int i, j, k;
+
+	for (i = 0; i < ARRAY_SIZE(hwmi_cache_policies); i++) {
+		for (j = 0; j < ARRAY_SIZE(hwmi_cache_policies[i].set); j++) {
+			if (hwmi_cache_policies[i].set[j] == cmd)
+				break;
+		}
+		if (j == ARRAY_SIZE(hwmi_cache_policies[i].set))
+			continue;
+
+		spin_lock(&cache->lock);
+		cache->gen++;
+		for (k = 0; k < HWMI_CACHE_SIZE; k++) {
+			if (huawei_wmi_cmd_code(cache->entries[k].arg) ==
+					hwmi_cache_policies[i].get)
+				cache->entries[k].valid = false;
+		}
+		spin_unlock(&cache->lock);
 	}
 }
 
-/* Smart charge */
+static void huawei_wmi_cache_flush(struct huawei_wmi *huawei)
+{
+	struct huawei_wmi_cache *cache = &huawei->cache;
+	int i;
+
+	spin_lock(&cache->lock);
+	cache->gen++;
+	for (i = 0; i < HWMI_CACHE_SIZE; i++)
+		cache->entries[i].valid = false;
+	spin_unlock(&cache->lock);
+}
 
-static int huawei_wmi_smart_charge_get(int *mode, int *unknow, int *start, int *end)
+/* Validating decoder for any response shape HWMI is known to use. */
+static const u8 *huawei_wmi_resp_payload_slow(struct huawei_wmi *huawei,
+		const union acpi_object *obj, size_t *len, int *shape)
 {
-	u8 ret[HWMI_BUFF_SIZE];
-	int err;
+	if (!obj)
+		return NULL;
 
-	err = huawei_wmi_cmd(BATTERY_CHARGE_MODE_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+	switch (obj->type) {
+	/* Models that implement both "legacy" and HWMI tend to return a 0x104
+	 * sized buffer instead of a package of 0x4 and 0x100 buffers.
+	 */
+	case ACPI_TYPE_BUFFER:
+		if (obj->buffer.length != 0x104) {
+			dev_err_ratelimited(huawei->dev, "Bad buffer length, got %d\n", obj->buffer.length);
+			return NULL;
+		}
 
-	if (mode)
-		*mode = ret[1];
-	if (unknow)
-		*unknow = ret[2];
-	if (start)
-		*start = ret[3];
-	if (end)
-		*end = ret[4];
+		// Skip the first 4 bytes.
+		*len = HWMI_BUFF_SIZE;
+		*shape = HWMI_SHAPE_BUFFER;
+		return obj->buffer.pointer + 4;
+	/* HWMI returns a package with 2 buffer elements, one of 4 bytes and the
+	 * other is 256 bytes.
+	 */
+	case ACPI_TYPE_PACKAGE:
+		if (obj->package.count != 2) {
+			dev_err_ratelimited(huawei->dev, "Bad package count, got %d\n", obj->package.count);
+			return NULL;
+		}
 
-	return 0;
+		obj = &obj->package.elements[1];
+		if (obj->type != ACPI_TYPE_BUFFER || !obj->buffer.length) {
+			dev_err_ratelimited(huawei->dev, "Bad package element type, got %d\n", obj->type);
+			return NULL;
+		}
+
+		*len = obj->buffer.length;
+		*shape = HWMI_SHAPE_PACKAGE;
+		return obj->buffer.pointer;
+	/* Shouldn't get here! */
+	default:
+		dev_err_ratelimited(huawei->dev, "Unexpected obj type, got: %d\n", obj->type);
+		return NULL;
+	}
 }
 
-static int huawei_wmi_smart_charge_set(int mode, int unknow, int start, int end)
+/* Returns the 0x100 bytes payload of a HWMI response. A model sticks to one
+ * response shape, so it is fingerprinted from the first response, i.e. at
+ * probe, and later responses only check that they still match it. Anything
+ * else goes through the validating decoder and is counted as a fallback.
+ */
+static const u8 *huawei_wmi_resp_payload(struct huawei_wmi *huawei,
+		const union acpi_object *obj, size_t *len, int *shape)
 {
-	union hwmi_arg arg;
-	int err;
+	const u8 *payload;
+
+	switch (huawei->shape) {
+	case HWMI_SHAPE_BUFFER:
+		if (likely(obj && obj->type == ACPI_TYPE_BUFFER &&
+				obj->buffer.length == 0x104)) {
+			*len = HWMI_BUFF_SIZE;
+			*shape = HWMI_SHAPE_BUFFER;
+			return obj->buffer.pointer + 4;
+		}
+		break;
+	case HWMI_SHAPE_PACKAGE:
+		if (likely(obj && obj->type == ACPI_TYPE_PACKAGE &&
+				obj->package.count == 2 &&
+				obj->package.elements[1].type == ACPI_TYPE_BUFFER &&
+				obj->package.elements[1].buffer.length == HWMI_BUFF_SIZE)) {
+			*len = HWMI_BUFF_SIZE;
+			*shape = HWMI_SHAPE_PACKAGE;
+			return obj->package.elements[1].buffer.pointer;
+		}
+		break;
+	}
 
-	if (start < 0 || end < 0 || start > 100 || end > 100)
-		return -EINVAL;
+	if (huawei->shape != HWMI_SHAPE_NONE)
+		huawei->shape_fallbacks++;
 
-	arg.cmd = BATTERY_CHARGE_MODE_SET;
-	arg.args[2] = (u8) mode;
-	arg.args[3] = (u8) unknow;
-	arg.args[4] = (u8) start;
-	arg.args[5] = (u8) end;
+	payload = huawei_wmi_resp_payload_slow(huawei, obj, len, shape);
+	if (payload && huawei->shape == HWMI_SHAPE_NONE) {
+		huawei->shape = *shape;
+		dev_dbg(huawei->dev, "HWMI responds with a %s\n",
+			*shape == HWMI_SHAPE_BUFFER ? "buffer" : "package");
+	}
 
-	err = huawei_wmi_cmd(arg.cmd, NULL, 0);
-	return err;
+	return payload;
 }
 
-static ssize_t smart_charge_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+/* Recorder */
+
+/* Caller must hold wmi_lock. */
+static void huawei_wmi_rec_add(struct huawei_wmi *huawei, u64 arg, u64 ts,
+		u64 duration, int err, int retries, int shape,
+		const u8 *payload, size_t len)
 {
-	int err, start, end, mode, unknow;
+	struct huawei_wmi_recorder *rec = &huawei->rec;
+	struct hwmi_rec *r;
+	u64 head;
 
-	err = huawei_wmi_smart_charge_get(&mode, &unknow, &start, &end);
-	if (err)
-		return err;
+	if (!rec->size)
+		return;
 
-	return sprintf(buf, "%d %d %d %d\n", mode, unknow, start, end);
+	/* Readers of the record we overwrite have to drop it. */
+	head = rec->head;
+	WRITE_ONCE(rec->writing, head + 1);
+	smp_wmb();
+
+	r = &rec->recs[head & (rec->size - 1)];
+	r->ts = cpu_to_le64(ts);
+	r->arg = cpu_to_le64(arg);
+	r->duration = cpu_to_le64(duration);
+	r->err = cpu_to_le32(err);
+	r->len = min_t(size_t, len, HWMI_REC_RESP);
+	r->prio = huawei->prio;
+	r->shape = shape;
+	r->retries = retries;
+	memset(r->resp, 0, sizeof(r->resp));
+	if (payload)
+		memcpy(r->resp, payload, r->len);
+
+	smp_store_release(&rec->head, head + 1);
 }
 
-static ssize_t smart_charge_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
-{
-	int err, start, end, mode, unknow;
+/* Circuit breaker */
 
-	if (sscanf(buf, "%d %d %d %d", &mode, &unknow, &start, &end) != 4)
-		return -EINVAL;
+/* Caller must hold breaker->lock. */
+static struct huawei_wmi_breaker_entry *huawei_wmi_breaker_find(
+		struct huawei_wmi_breaker *breaker, u64 arg)
+{
+	int i;
 
-	err = huawei_wmi_smart_charge_set(mode, unknow, start, end);
-	if (err)
-		return err;
+	for (i = 0; i < HWMI_CMD_SIZE; i++) {
+		if (breaker->entries[i].valid && breaker->entries[i].arg == arg)
+			return &breaker->entries[i];
+	}
 
-	return size;
+	return NULL;
 }
 
-static DEVICE_ATTR_RW(smart_charge);
-
-static void huawei_wmi_smart_charge_setup(struct device *dev)
+/* Returns the last error of a GET whose breaker is open, 0 otherwise. */
+static int huawei_wmi_breaker_check(struct huawei_wmi *huawei, u64 arg)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-
-	huawei->smart_charge_available = true;
-	if (huawei_wmi_smart_charge_get(NULL, NULL, NULL, NULL)) {
-		huawei->smart_charge_available = false;
-		return;
+	struct huawei_wmi_breaker *breaker = &huawei->breaker;
+	struct huawei_wmi_breaker_entry *entry;
+	int err = 0;
+
+	spin_lock(&breaker->lock);
+	entry = huawei_wmi_breaker_find(breaker, arg);
+	if (entry && entry->state != HWMI_BREAKER_CLOSED) {
+		err = entry->err;
+		breaker->rejected++;
 	}
+	spin_unlock(&breaker->lock);
 
-	device_create_file(dev, &dev_attr_smart_charge);
+	return err;
 }
 
-static void huawei_wmi_smart_charge_exit(struct device *dev)
+/* Accounts the outcome of a GET. A success closes its breaker, threshold
+ * consecutive failures open it for backoff_ms and a failed probe doubles the
+ * backoff. Only firmware failures count, not running out of memory or time.
+ */
+static void huawei_wmi_breaker_record(struct huawei_wmi *huawei, u64 arg,
+		int err)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct huawei_wmi_breaker *breaker = &huawei->breaker;
+	struct huawei_wmi_breaker_entry *entry;
+	unsigned long delay = 0;
+	int i;
 
-	if (huawei->smart_charge_available) {
-		device_remove_file(dev, &dev_attr_smart_charge);
+	if (err && err != -ENODEV && err != -EIO)
+		return;
+
+	spin_lock(&breaker->lock);
+	entry = huawei_wmi_breaker_find(breaker, arg);
+	if (!err) {
+		if (entry)
+			entry->valid = false;
+		goto out;
 	}
-}
 
-/* Fn lock */
+	if (!entry) {
+		if (!breaker->threshold)
+			goto out;
 
-static int huawei_wmi_fn_lock_get(int *on)
-{
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-	int err, i;
+		/* Take a free slot or the closed one that failed the least. */
+		for (i = 0; i < HWMI_CMD_SIZE; i++) {
+			if (!breaker->entries[i].valid) {
+				entry = &breaker->entries[i];
+				break;
+			}
+			if (breaker->entries[i].state == HWMI_BREAKER_CLOSED &&
+					(!entry || breaker->entries[i].fails < entry->fails))
+				entry = &breaker->entries[i];
+		}
+		if (!entry)
+			goto out;
 
-	err = huawei_wmi_cmd(FN_LOCK_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+		memset(entry, 0, sizeof(*entry));
+		entry->arg = arg;
+		entry->valid = true;
+	}
 
-	/* Find the first non-zero value. Return status is ignored. */
-	i = 1;
-	do {
-		if (on)
-			*on = ret[i] - 1; // -1 undefined, 0 off, 1 on.
-	} while (i < 0xff && !ret[i++]);
+	entry->fails++;
+	entry->err = err;
+	if (entry->state == HWMI_BREAKER_PROBE) {
+		entry->backoff_ms = min(entry->backoff_ms * 2,
+				breaker->backoff_max_ms);
+	} else if (entry->state == HWMI_BREAKER_CLOSED && breaker->threshold &&
+			entry->fails >= breaker->threshold) {
+		entry->backoff_ms = breaker->backoff_ms;
+		breaker->trips++;
+	} else {
+		goto out;
+	}
+	entry->backoff_ms = max_t(u32, entry->backoff_ms, 1);
 
-	return 0;
-}
+	entry->state = HWMI_BREAKER_OPEN;
+	entry->until = jiffies + msecs_to_jiffies(entry->backoff_ms);
 
-static int huawei_wmi_fn_lock_set(int on)
-{
-	union hwmi_arg arg;
+	/* The work reschedules itself for any later breaker. */
+	if (!breaker->armed || time_before(entry->until, breaker->next)) {
+		breaker->armed = true;
+		breaker->next = entry->until;
+		delay = msecs_to_jiffies(entry->backoff_ms);
+	}
 
-	arg.cmd = FN_LOCK_SET;
-	arg.args[2] = on + 1; // 0 undefined, 1 off, 2 on.
+out:
+	spin_unlock(&breaker->lock);
 
-	return huawei_wmi_cmd(arg.cmd, NULL, 0);
+	if (delay)
+		mod_delayed_work(huawei_wmi_wq, &breaker->work, delay);
 }
 
-static ssize_t fn_lock_state_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+/* HWMI takes a 64 bit input and returns either a package with 2 buffers, one of
+ * 4 bytes and the other of 256 bytes, or one buffer of size 0x104 (260) bytes.
+ * The first 4 bytes are ignored, we ignore the first 4 bytes buffer if we got a
+ * package, or skip the first 4 if a buffer of 0x104 is used. The first byte of
+ * the remaining 0x100 sized buffer has the return status of every call. In case
+ * the return status is non-zero, we return -ENODEV. Otherwise decode is handed
+ * the response where it lies so callers only copy what they use.
+ *
+ * Caller must hold wmi_lock.
+ */
+static int __huawei_wmi_cmd_decode(struct huawei_wmi *huawei, u64 arg,
+		hwmi_decode_t decode, void *ctx)
 {
-	int err, on;
+	struct huawei_wmi_cmd_entry *entry;
+	struct acpi_buffer out = { 0, NULL };
+	struct hwmi_cache_policy *policy;
+	struct acpi_buffer in;
+	int shape = HWMI_SHAPE_NONE;
+	const u8 *payload = NULL;
+	unsigned int gen = 0;
+	int retries = 0;
+	u64 start, duration;
+	u8 status = 0;
+	size_t len = 0;
+	int err, i;
 
-	err = huawei_wmi_fn_lock_get(&on);
-	if (err)
-		return err;
+	if (huawei->lockstat.feat_cur == HWMI_FEAT_NONE)
+		huawei->lockstat.feat_cur = huawei_wmi_feature(huawei, arg);
 
-	return sprintf(buf, "%d\n", on);
-}
+	policy = huawei_wmi_cache_policy(arg);
+	if (policy && policy->ttl_ms) {
+		if (huawei_wmi_cache_lookup(huawei, arg, decode, ctx))
+			return 0;
+		gen = huawei_wmi_cache_miss(huawei);
+	}
 
-static ssize_t fn_lock_state_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
-{
-	int on, err;
+	if (huawei_wmi_cmd_missing(huawei, arg))
+		return -ENODEV;
 
-	if (kstrtoint(buf, 10, &on) ||
-			on < 0 || on > 1)
-		return -EINVAL;
+	huawei_wmi_stat_add(huawei, arg, HWMI_STAT_CALLS, 1);
+	in.length = sizeof(arg);
+	in.pointer = &arg;
 
-	err = huawei_wmi_fn_lock_set(on);
-	if (err)
-		return err;
+	entry = huawei_wmi_cmd_entry(huawei, huawei_wmi_cmd_code(arg));
+	if (entry) {
+		huawei_wmi_lat_record(&entry->wait, huawei->lock_wait);
+		huawei->lock_wait = 0;
+	}
+	start = ktime_get_ns();
+	trace_huawei_wmi_cmd_issue(arg);
 
-	return size;
-}
+	/* Some models require calling HWMI twice to execute a command. We evaluate
+	 * HWMI and if we get a non-zero return status we evaluate it again, unless
+	 * we learned that the second evaluation never helps for this command.
+	 */
+	for (i = 0; i < 2; i++) {
+		huawei_wmi_resp_put(huawei, &out);
+		payload = NULL;
+		len = 0;
 
-static DEVICE_ATTR_RW(fn_lock_state);
+		err = huawei_wmi_resp_eval(huawei, &in, &out, !!policy);
+		if (err)
+			goto fail_cmd;
 
-static void huawei_wmi_fn_lock_setup(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+		payload = huawei_wmi_resp_payload(huawei, out.pointer, &len, &shape);
+		if (!payload) {
+			len = 0;
+			err = -EIO;
+			goto fail_cmd;
+		}
 
-	huawei->fn_lock_available = true;
-	if (huawei_wmi_fn_lock_get(NULL)) {
-		huawei->fn_lock_available = false;
-		return;
+		status = *payload;
+		if (!status) {
+			if (i && entry)
+				entry->recovered++;
+			break;
+		}
+
+		if (i)
+			break;
+		if (entry)
+			entry->failed++;
+		if (!huawei_wmi_retry_wanted(entry))
+			break;
+
+		trace_huawei_wmi_cmd_retry(arg, status);
+		retries++;
 	}
 
-	device_create_file(dev, &dev_attr_fn_lock_state);
-}
+	err = status ? -ENODEV : 0;
 
-static void huawei_wmi_fn_lock_exit(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	if (!err && policy && policy->ttl_ms)
+		huawei_wmi_cache_store(huawei, policy, gen, arg, payload, len);
 
-	if (huawei->fn_lock_available)
-		device_remove_file(dev, &dev_attr_fn_lock_state);
-}
+	if (!err && decode)
+		decode(payload, len, ctx);
 
-/* Keyboard backlight */
+fail_cmd:
+	duration = ktime_get_ns() - start;
+	trace_huawei_wmi_cmd_complete(arg, status, shape, retries, duration, err);
+	if (!err)
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_OK, 1);
+	else if (err == -EIO)
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_EIO, 1);
+	else if (status)
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_STATUS, 1);
+	if (retries)
+		huawei_wmi_stat_add(huawei, arg, HWMI_STAT_RETRIES, retries);
+	huawei_wmi_rec_add(huawei, arg, start, duration, err, retries, shape,
+			payload, len);
+	/* payload is only set if the last evaluation went through. */
+	huawei_wmi_cmd_probed(huawei, arg, err, payload ? status : 0);
+	if (entry)
+		huawei_wmi_lat_record(&entry->eval, duration);
+	huawei_wmi_resp_put(huawei, &out);
+	if (policy)
+		huawei_wmi_breaker_record(huawei, arg, err);
+	else
+		huawei_wmi_cache_invalidate(huawei, arg);
+	return err;
+}
 
-static int huawei_wmi_kbdlight_get(int *level)
+/* Same as __huawei_wmi_cmd_decode(), copying up to buflen bytes of the
+ * response to buf.
+ */
+static int __huawei_wmi_cmd(struct huawei_wmi *huawei, u64 arg,
+		u8 *buf, size_t buflen)
 {
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-	int err;
+	struct hwmi_copy copy = { buf, buflen };
 
-	err = huawei_wmi_cmd(KBDLIGHT_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
-	if (!ret[2])
-		return -ENODEV;
+	return __huawei_wmi_cmd_decode(huawei, arg,
+			buf ? huawei_wmi_decode_copy : NULL, &copy);
+}
 
-	/* Some models like the MACH-WX9 use 0x01, 0x02, and 0x04 for off, level 1,
-	 * and level 2 respectively rather than 0x04, 0x08, and 0x10.
-	 */
-	huawei_wmi->kbdlight_quirk_input = ret[1] == 0xff;
+/* Single-flight GETs */
 
-	if (level) {
-		*level = 0;
-		while (ret[2] >>= 1) {
-			*level += 1;
-		}
+/* Caller must hold huawei_wmi_flights.lock. */
+static struct huawei_wmi_flight *huawei_wmi_flight_find(
+		struct huawei_wmi *huawei, u64 arg, unsigned int gen, int prio)
+{
+	struct huawei_wmi_flight *flight;
 
-		if (ret[1] != 0xff)
-			*level -= 2;
+	list_for_each_entry(flight, &huawei->flights.list, list) {
+		if (flight->arg == arg && flight->gen == gen &&
+				flight->prio <= prio)
+			return flight;
 	}
 
-	return 0;
+	return NULL;
 }
 
-static int huawei_wmi_kbdlight_set(int level)
+/* Joins an identical GET that is in flight or starts a new one. A GET is
+ * only joined if no SET was issued since it started and it won't wait for
+ * wmi_lock with a lower priority than ours. Returns NULL if the pool
+ * is exhausted, the caller then runs on its own.
+ */
+static struct huawei_wmi_flight *huawei_wmi_flight_get(
+		struct huawei_wmi *huawei, u64 arg, int prio, bool *leader)
 {
-	union hwmi_arg arg;
+	struct huawei_wmi_flights *flights = &huawei->flights;
+	struct huawei_wmi_flight *flight, *new = NULL;
+	unsigned int gen;
+	int i;
 
-	// Huawei laptops only support 3 kbdlight levels
-	if (level < 0 || level > 2)
-		return -EINVAL;
-	if (!huawei_wmi->kbdlight_quirk_input)
-		level += 2;
+	spin_lock(&huawei->cache.lock);
+	gen = huawei->cache.gen;
+	spin_unlock(&huawei->cache.lock);
 
-	arg.cmd = KBDLIGHT_SET;
-	arg.args[2] = 1 << level;
+	spin_lock(&flights->lock);
+	flight = huawei_wmi_flight_find(huawei, arg, gen, prio);
+	if (flight)
+		goto join;
+
+	for (i = 0; i < HWMI_FLIGHT_POOL; i++) {
+		if (!flights->pool[i].ref) {
+			new = &flights->pool[i];
+			break;
+		}
+	}
+	if (!new) {
+		flights->exhausted++;
+		spin_unlock(&flights->lock);
+		return NULL;
+	}
 
-	return huawei_wmi_cmd(arg.cmd, NULL, 0);
+	new->arg = arg;
+	new->gen = gen;
+	new->prio = prio;
+	new->ref = 1;
+	new->err = 0;
+	new->len = 0;
+	init_completion(&new->done);
+	list_add(&new->list, &flights->list);
+	flights->issued++;
+	spin_unlock(&flights->lock);
+
+	*leader = true;
+	return new;
+
+join:
+	flight->ref++;
+	flights->saved++;
+	spin_unlock(&flights->lock);
+
+	*leader = false;
+	return flight;
 }
 
-static int huawei_wmi_kbdlight_set_auto(int level)
+static void huawei_wmi_flight_put(struct huawei_wmi *huawei,
+		struct huawei_wmi_flight *flight)
 {
-	union hwmi_arg arg;
-	int err;
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-
-	if (level < 0 || level > 255)
-		return -EINVAL;
-
-	arg.cmd = KBDLIGHT_MODE_SET;
-	arg.args[2] = KBDLIGHT_MODE_AUTO;
-	err = huawei_wmi_cmd(arg.cmd, NULL, 0);
-	if (!err)
-		msleep(10);
+	spin_lock(&huawei->flights.lock);
+	flight->ref--;
+	spin_unlock(&huawei->flights.lock);
+}
 
-	arg.cmd = KBDLIGHT_SET_AUTO;
-	arg.args[2] = level;
+/* Publishes the leader's result and wakes up everyone who joined. */
+static void huawei_wmi_flight_done(struct huawei_wmi *huawei,
+		struct huawei_wmi_flight *flight, int err)
+{
+	spin_lock(&huawei->flights.lock);
+	list_del(&flight->list);
+	spin_unlock(&huawei->flights.lock);
 
-	return huawei_wmi_cmd(arg.cmd, NULL, 0);
+	flight->err = err;
+	complete_all(&flight->done);
+	huawei_wmi_flight_put(huawei, flight);
 }
 
-static ssize_t kbdlight_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
-{
-	int err, level;
+struct hwmi_flight_decode {
+	struct huawei_wmi_flight *flight;
+	hwmi_decode_t decode;
+	void *ctx;
+};
 
-	err = huawei_wmi_kbdlight_get(&level);
-	if (err)
-		return err;
+/* Keeps a copy of the response for the joiners and decodes it for the
+ * leader.
+ */
+static void huawei_wmi_flight_decode(const u8 *resp, size_t len, void *ctx)
+{
+	struct hwmi_flight_decode *fd = ctx;
 
-	return sprintf(buf, "%d\n", level);
+	fd->flight->len = min_t(size_t, len, HWMI_BUFF_SIZE);
+	memcpy(fd->flight->buf, resp, fd->flight->len);
+	if (fd->decode)
+		fd->decode(resp, len, fd->ctx);
 }
 
-static ssize_t kbdlight_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+/* Writes must not get lost, they wait for as long as it takes. Reads and
+ * interactive commands give up after a while.
+ */
+static unsigned int huawei_wmi_lock_timeout(struct huawei_wmi *huawei,
+		u64 arg, int prio)
 {
-	int level, err;
+	if (prio == HWMI_PRIO_INTERACTIVE)
+		return READ_ONCE(huawei->wdog.interactive_ms);
+	if (huawei_wmi_cache_policy(arg))
+		return READ_ONCE(huawei->wdog.read_ms);
+	return 0;
+}
 
-	if (kstrtoint(buf, 10, &level))
-		return -EINVAL;
+static int huawei_wmi_cmd_decode_prio(struct huawei_wmi *huawei, u64 arg,
+		hwmi_decode_t decode, void *ctx, int prio)
+{
+	struct huawei_wmi_flight *flight;
+	struct hwmi_cache_policy *policy;
+	unsigned int timeout_ms;
+	bool leader;
+	int err;
 
-	if (quirks && quirks->kbdlight_auto)
-		err = huawei_wmi_kbdlight_set_auto(level);
-	else
-		err = huawei_wmi_kbdlight_set(level);
-	if (err)
-		return err;
+	/* Serve cache hits without contending on wmi_lock. */
+	policy = huawei_wmi_cache_policy(arg);
+	if (policy && policy->ttl_ms &&
+			huawei_wmi_cache_lookup(huawei, arg, decode, ctx))
+		return 0;
 
-	return size;
-}
+	if (policy) {
+		err = huawei_wmi_breaker_check(huawei, arg);
+		if (err)
+			return err;
+	}
 
-static DEVICE_ATTR_RW(kbdlight);
+	/* Identical GETs share one evaluation, whatever their TTL. */
+	timeout_ms = huawei_wmi_lock_timeout(huawei, arg, prio);
+	flight = policy ? huawei_wmi_flight_get(huawei, arg, prio, &leader) : NULL;
+	if (flight && !leader) {
+		/* Joiners are bound like wmi_lock waiters, a leader stuck in
+		 * AML must not take them all down with it. Our reference keeps
+		 * the flight around if we leave early.
+		 */
+		if (timeout_ms && huawei_wmi_stalled(huawei)) {
+			spin_lock(&huawei->wdog.lock);
+			huawei->wdog.busy++;
+			spin_unlock(&huawei->wdog.lock);
+			err = -EBUSY;
+		} else if (!timeout_ms) {
+			wait_for_completion(&flight->done);
+			err = flight->err;
+		} else if (!wait_for_completion_timeout(&flight->done,
+				msecs_to_jiffies(timeout_ms))) {
+			err = -ETIMEDOUT;
+		} else {
+			err = flight->err;
+		}
+		if (!err && decode)
+			decode(flight->buf, flight->len, ctx);
+		huawei_wmi_flight_put(huawei, flight);
+		return err;
+	}
 
-static void huawei_wmi_kbdlight_setup(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	err = huawei_wmi_lock(huawei, prio, timeout_ms);
+	if (err)
+		goto out;
 
-	huawei->kbdlight_available = true;
-	if (!(acpi_has_method(NULL, "\\SKBL") || (quirks && quirks->kbdlight_auto))
-	    && huawei_wmi_kbdlight_get(NULL)) {
-		huawei->kbdlight_available = false;
-		return;
+	if (flight) {
+		struct hwmi_flight_decode fd = { flight, decode, ctx };
+
+		err = __huawei_wmi_cmd_decode(huawei, arg,
+				huawei_wmi_flight_decode, &fd);
+	} else {
+		err = __huawei_wmi_cmd_decode(huawei, arg, decode, ctx);
 	}
+	huawei_wmi_unlock(huawei);
 
-	device_create_file(dev, &dev_attr_kbdlight);
+out:
+	if (flight)
+		huawei_wmi_flight_done(huawei, flight, err);
+
+	return err;
 }
 
-static void huawei_wmi_kbdlight_exit(struct device *dev)
+static int huawei_wmi_cmd_prio(struct huawei_wmi *huawei, u64 arg,
+		u8 *buf, size_t buflen, int prio)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct hwmi_copy copy = { buf, buflen };
 
-	if (huawei->kbdlight_available)
-		device_remove_file(dev, &dev_attr_kbdlight);
+	return huawei_wmi_cmd_decode_prio(huawei, arg,
+			buf ? huawei_wmi_decode_copy : NULL, &copy, prio);
 }
 
-/* Keyboard backlight timeout */
-
-static int huawei_wmi_kbdlight_timeout_get(int *seconds)
+static int huawei_wmi_cmd_default_prio(struct huawei_wmi *huawei, u64 arg)
 {
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-	int err;
-
-	err = huawei_wmi_cmd(KBDLIGHT_TIMEOUT_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
-
-	if (seconds)
-		*seconds = ret[1] | (ret[2] << 8);
-
-	return 0;
+	switch (huawei_wmi_cmd_code(arg)) {
+	case MICMUTE_LED_SET:
+		return HWMI_PRIO_INTERACTIVE;
+	case FAN_SPEED_GET:
+	case TEMP_GET:
+		return HWMI_PRIO_BACKGROUND;
+	default:
+		return huawei_wmi_discovering(huawei) ?
+			HWMI_PRIO_BACKGROUND : HWMI_PRIO_CONTROL;
+	}
 }
 
-static int huawei_wmi_kbdlight_timeout_set(int seconds)
+static int huawei_wmi_cmd_decode(struct huawei_wmi *huawei, u64 arg,
+		hwmi_decode_t decode, void *ctx)
 {
-	union hwmi_arg arg;
-
-	arg.cmd = KBDLIGHT_TIMEOUT_SET;
-	arg.args[2] = (seconds & 0xff);
-	arg.args[3] = (seconds >> 8);
-
-	return huawei_wmi_cmd(arg.cmd, NULL, 0);
-
+	return huawei_wmi_cmd_decode_prio(huawei, arg, decode, ctx,
+			huawei_wmi_cmd_default_prio(huawei, arg));
 }
 
-static ssize_t kbdlight_timeout_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+static int huawei_wmi_cmd(struct huawei_wmi *huawei, u64 arg, u8 *buf, size_t buflen)
 {
-	int err, seconds;
-
-	err = huawei_wmi_kbdlight_timeout_get(&seconds);
-	if (err)
-		return err;
-
-	return sprintf(buf, "%d\n", seconds);
+	return huawei_wmi_cmd_prio(huawei, arg, buf, buflen,
+			huawei_wmi_cmd_default_prio(huawei, arg));
 }
 
-static ssize_t kbdlight_timeout_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+/* Probes GETs whose backoff ran out. Their breakers stay open while being
+ * probed, callers don't get to be the ones that find out.
+ */
+static void huawei_wmi_breaker_work(struct work_struct *work)
 {
-	int seconds, err;
+	struct huawei_wmi *huawei = container_of(to_delayed_work(work),
+			struct huawei_wmi, breaker.work);
+	struct huawei_wmi_breaker *breaker = &huawei->breaker;
+	struct huawei_wmi_breaker_entry *entry;
+	unsigned long next = 0;
+	bool pending = false;
+	u64 arg;
+	int i, err;
 
-	if (kstrtoint(buf, 10, &seconds) ||
-			seconds < 0 || seconds > 0xffff)
-		return -EINVAL;
+	spin_lock(&breaker->lock);
+	breaker->armed = false;
+	spin_unlock(&breaker->lock);
 
-	err = huawei_wmi_kbdlight_timeout_set(seconds);
-	if (err)
-		return err;
+	for (i = 0; i < HWMI_CMD_SIZE; i++) {
+		entry = &breaker->entries[i];
 
-	return size;
-}
+		spin_lock(&breaker->lock);
+		if (!entry->valid || entry->state != HWMI_BREAKER_OPEN ||
+				time_before(jiffies, entry->until)) {
+			spin_unlock(&breaker->lock);
+			continue;
+		}
+		entry->state = HWMI_BREAKER_PROBE;
+		arg = entry->arg;
+		spin_unlock(&breaker->lock);
+
+		err = huawei_wmi_lock(huawei, HWMI_PRIO_BACKGROUND,
+				READ_ONCE(huawei->wdog.read_ms));
+		if (!err) {
+			__huawei_wmi_cmd_decode(huawei, arg, NULL, NULL);
+			huawei_wmi_unlock(huawei);
+		}
 
-static DEVICE_ATTR_RW(kbdlight_timeout);
+		/* Didn't get to evaluate it, try again after the same backoff. */
+		spin_lock(&breaker->lock);
+		if (entry->valid && entry->arg == arg &&
+				entry->state == HWMI_BREAKER_PROBE) {
+			entry->state = HWMI_BREAKER_OPEN;
+			entry->until = jiffies + msecs_to_jiffies(entry->backoff_ms);
+		}
+		spin_unlock(&breaker->lock);
+	}
 
-static void huawei_wmi_kbdlight_timeout_setup(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-	huawei->kbdlight_timeout_available = true;
-	if (huawei_wmi_kbdlight_timeout_get(NULL)) {
-		huawei->kbdlight_timeout_available = false;
-		return;
+	spin_lock(&breaker->lock);
+	for (i = 0; i < HWMI_CMD_SIZE; i++) {
+		entry = &breaker->entries[i];
+		if (!entry->valid || entry->state != HWMI_BREAKER_OPEN)
+			continue;
+		if (!pending || time_before(entry->until, next))
+			next = entry->until;
+		pending = true;
+	}
+	if (pending && (!breaker->armed || time_before(next, breaker->next))) {
+		breaker->armed = true;
+		breaker->next = next;
+	} else {
+		pending = false;
 	}
+	spin_unlock(&breaker->lock);
 
-	device_create_file(dev, &dev_attr_kbdlight_timeout);
+	if (pending)
+		mod_delayed_work(huawei_wmi_wq, &breaker->work,
+				time_after(next, jiffies) ? next - jiffies : 0);
 }
 
-static void huawei_wmi_kbdlight_timeout_exit(struct device *dev)
+/* Batched commands */
+
+struct hwmi_batch {
+	union hwmi_arg arg;
+	u8 *buf;		/* optional response buffer */
+	size_t buflen;
+	unsigned int delay_ms;	/* sleep after a successful command */
+	int err;		/* per-command status */
+};
+
+/* Runs count commands back-to-back under a single wmi_lock hold so no other
+ * caller can interleave with a multi-step sequence. Each entry gets its own
+ * status in err. If stop_on_error is set, the remaining entries are skipped
+ * and marked -ECANCELED after the first failure. Returns the first error.
+ *
+ * Caller must hold wmi_lock.
+ */
+static int __huawei_wmi_cmd_batch(struct huawei_wmi *huawei,
+		struct hwmi_batch *batch, int count, bool stop_on_error)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err = 0, i;
 
-	if (huawei->kbdlight_timeout_available)
-		device_remove_file(dev, &dev_attr_kbdlight_timeout);
-}
+	for (i = 0; i < count; i++) {
+		if (err && stop_on_error) {
+			batch[i].err = -ECANCELED;
+			continue;
+		}
 
-/* Power unlock */
+		batch[i].err = __huawei_wmi_cmd(huawei, batch[i].arg.cmd,
+				batch[i].buf, batch[i].buflen);
+		if (!batch[i].err && batch[i].delay_ms)
+			msleep(batch[i].delay_ms);
+		if (batch[i].err && !err)
+			err = batch[i].err;
+	}
 
-static int huawei_wmi_power_unlock_get(int *on)
+	return err;
+}
+
+static int huawei_wmi_cmd_batch(struct huawei_wmi *huawei,
+		struct hwmi_batch *batch, int count, bool stop_on_error, int prio)
 {
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-	int err;
+	int err, i;
 
-	err = huawei_wmi_cmd(POWER_UNLOCK_GET, ret, HWMI_BUFF_SIZE);
-	if (err)
+	err = huawei_wmi_lock(huawei, prio,
+			huawei_wmi_lock_timeout(huawei, batch[0].arg.cmd, prio));
+	if (err) {
+		for (i = 0; i < count; i++)
+			batch[i].err = err;
 		return err;
+	}
 
-	if (on)
-		*on = ret[1];
+	err = __huawei_wmi_cmd_batch(huawei, batch, count, stop_on_error);
+	huawei_wmi_unlock(huawei);
 
-	return 0;
+	return err;
 }
 
-static int huawei_wmi_power_unlock_set(int on)
-{
-	union hwmi_arg arg;
+/* State snapshot */
 
-	arg.cmd = POWER_UNLOCK_SET;
-	arg.args[2] = on;
+/* Whether an attribute is read from the snapshot or always queried. Values
+ * only the driver changes default to the snapshot. Nothing samples in the
+ * background and the firmware or another tool can still change a value, so
+ * one older than max_age_ms is queried again.
+ */
+static struct hwmi_snap_mode {
+	const char *name;
+	bool snapshot;
+	u32 max_age_ms;
+} hwmi_snap_modes[] = {
+	[HWMI_SNAP_FN_LOCK] = { "fn_lock_state", false, 1000 },
+	[HWMI_SNAP_KBDLIGHT] = { "kbdlight", false, 1000 },
+	[HWMI_SNAP_KBDLIGHT_TIMEOUT] = { "kbdlight_timeout", true, 30000 },
+	[HWMI_SNAP_POWER_UNLOCK] = { "power_unlock", true, 5000 },
+	[HWMI_SNAP_BATTERY] = { "charge_control_thresholds", true, 5000 },
+	[HWMI_SNAP_FAN] = { "fan_input", false, 1000 },
+	[HWMI_SNAP_TEMP] = { "temp_input", false, 1000 },
+};
 
-	return huawei_wmi_cmd(arg.cmd, NULL, 0);
+static void huawei_wmi_snap_put(struct huawei_wmi *huawei, int idx,
+		const int *val, int n)
+{
+	struct huawei_wmi_snapshot *snap = &huawei->snap;
+	int i;
 
+	write_seqlock(&snap->lock);
+	for (i = 0; i < n; i++) {
+		snap->val[idx + i] = val[i];
+		snap->stamp[idx + i] = jiffies;
+		__set_bit(idx + i, snap->valid);
+	}
+	write_sequnlock(&snap->lock);
 }
 
-static ssize_t power_unlock_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+static void huawei_wmi_snap_forget(struct huawei_wmi *huawei, int idx, int n)
 {
-	int err, on;
+	struct huawei_wmi_snapshot *snap = &huawei->snap;
 
-	err = huawei_wmi_power_unlock_get(&on);
-	if (err)
-		return err;
-
-	return sprintf(buf, "%d\n", on);
+	write_seqlock(&snap->lock);
+	bitmap_clear(snap->valid, idx, n);
+	write_sequnlock(&snap->lock);
 }
 
-static ssize_t power_unlock_store(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t size)
+/* Returns true if the attribute is in snapshot mode and all n values are
+ * known and recent enough, which are then copied to val. Never sleeps.
+ */
+static bool huawei_wmi_snap_get(struct huawei_wmi *huawei, int mode, int idx,
+		int *val, int n)
 {
-	int on, err;
+	struct huawei_wmi_snapshot *snap = &huawei->snap;
+	unsigned long max_age;
+	unsigned int seq;
+	bool valid;
+	int i;
 
-	if (kstrtoint(buf, 10, &on) ||
-			on < 0 || on > 1)
-		return -EINVAL;
+	if (!READ_ONCE(hwmi_snap_modes[mode].snapshot))
+		return false;
 
-	err = huawei_wmi_power_unlock_set(on);
-	if (err)
-		return err;
+	max_age = msecs_to_jiffies(READ_ONCE(hwmi_snap_modes[mode].max_age_ms));
+	do {
+		seq = read_seqbegin(&snap->lock);
+		valid = true;
+		for (i = 0; i < n; i++) {
+			valid &= test_bit(idx + i, snap->valid) &&
+				time_before(jiffies, snap->stamp[idx + i] + max_age);
+			val[i] = snap->val[idx + i];
+		}
+	} while (read_seqretry(&snap->lock, seq));
 
-	return size;
+	return valid;
 }
 
-static DEVICE_ATTR_RW(power_unlock);
-
-static void huawei_wmi_power_unlock_setup(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-	huawei->power_unlock_available = true;
-	if (huawei_wmi_power_unlock_get(NULL)) {
-		huawei->power_unlock_available = false;
-		return;
-	}
-
-	device_create_file(dev, &dev_attr_power_unlock);
-}
+/* Async writes */
 
-static void huawei_wmi_power_unlock_exit(struct device *dev)
-{
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+/* Keeps the pending value of a two values slot (battery thresholds). */
+#define HWMI_ASYNC_KEEP -1
 
-	if (huawei->power_unlock_available)
-		device_remove_file(dev, &dev_attr_power_unlock);
-}
+static const char * const hwmi_async_names[] = {
+	[HWMI_ASYNC_KBDLIGHT] = "kbdlight",
+	[HWMI_ASYNC_KBDLIGHT_TIMEOUT] = "kbdlight_timeout",
+	[HWMI_ASYNC_FN_LOCK] = "fn_lock",
+	[HWMI_ASYNC_POWER_UNLOCK] = "power_unlock",
+	[HWMI_ASYNC_BATTERY] = "battery",
+};
 
-/* Hwmon subdriver */
+/* Default write budgets, per second and saved up */
+static const u32 hwmi_async_budgets[][2] = {
+	[HWMI_ASYNC_KBDLIGHT] = { 10, 5 },
+	[HWMI_ASYNC_KBDLIGHT_TIMEOUT] = { 2, 2 },
+	[HWMI_ASYNC_FN_LOCK] = { 5, 5 },
+	[HWMI_ASYNC_POWER_UNLOCK] = { 1, 2 },
+	[HWMI_ASYNC_BATTERY] = { 1, 2 },
+};
 
-/* Fan speed */
+static int huawei_wmi_async_apply(struct huawei_wmi *huawei, int slot,
+		const int *value);
 
-static int huawei_wmi_fan_speed_get(u8 num, int *rpm)
+/* Takes a write out of the slot's budget. A write costs a second's worth of
+ * credit divided by rate and credit builds up for burst writes at most.
+ * Returns 0 if the write may go now, the ns until it may otherwise. Caller
+ * must hold async->lock.
+ */
+static u64 huawei_wmi_async_take(struct huawei_wmi_async *async,
+		struct huawei_wmi_async_slot *entry)
 {
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
-	int err;
-
-	union hwmi_arg arg;
-	arg.cmd = FAN_SPEED_GET;
-	arg.args[2] = num;
+	u64 now = ktime_get_ns(), cost;
 
-	err = huawei_wmi_cmd(arg.cmd, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+	if (!entry->rate || async->draining)
+		return 0;
 
-	if (rpm)
-		*rpm = ret[1] | (ret[2] << 8);
+	cost = div_u64(NSEC_PER_SEC, entry->rate);
+	entry->credit = min(entry->credit + (now - entry->stamp),
+			cost * max_t(u32, entry->burst, 1));
+	entry->stamp = now;
+	if (entry->credit < cost)
+		return cost - entry->credit;
 
+	entry->credit -= cost;
 	return 0;
 }
 
-static ssize_t fan1_input_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+/* Whether a write of slot has to go through the queue: it's over budget or
+ * an older write is still pending and must not land after it. Counts it as
+ * throttled then.
+ */
+static bool huawei_wmi_async_throttle(struct huawei_wmi *huawei, int slot)
 {
-	int err, rpm;
+	struct huawei_wmi_async *async = &huawei->async;
+	struct huawei_wmi_async_slot *entry = &async->slots[slot];
+	bool throttled;
 
-	err = huawei_wmi_fan_speed_get(0, &rpm);
-	if (err)
-		return err;
+	spin_lock(&async->lock);
+	throttled = entry->pending || huawei_wmi_async_take(async, entry);
+	if (throttled)
+		entry->throttled++;
+	spin_unlock(&async->lock);
 
-	return sprintf(buf, "%d\n", rpm);
+	return throttled;
 }
 
-static ssize_t fan2_input_show(struct device *dev,
-		struct device_attribute *attr,
-		char *buf)
+/* Applies the pending write of slot, if any. Unless forced, a write over
+ * budget stays pending and the ns until it may go are returned.
+ */
+static u64 huawei_wmi_async_run(struct huawei_wmi *huawei, int slot,
+		bool force)
 {
-	int err, rpm;
+	struct huawei_wmi_async *async = &huawei->async;
+	struct huawei_wmi_async_slot *entry = &async->slots[slot];
+	u64 wait = 0;
+	int value[2];
+	int err;
+
+	mutex_lock(&async->apply_lock);
+	spin_lock(&async->lock);
+	if (!entry->pending)
+		goto unlock;
 
-	err = huawei_wmi_fan_speed_get(1, &rpm);
+	/* Over budget, it'll be written with whatever value is latest. */
+	if (!force)
+		wait = huawei_wmi_async_take(async, entry);
+	if (wait)
+		goto unlock;
+
+	entry->pending = false;
+	memcpy(value, entry->value, sizeof(value));
+	spin_unlock(&async->lock);
+
+	err = huawei_wmi_async_apply(huawei, slot, value);
 	if (err)
-		return err;
+		dev_err(huawei->dev, "Failed to apply write to slot %d, err %d\n", slot, err);
 
-	return sprintf(buf, "%d\n", rpm);
-}
+	spin_lock(&async->lock);
+	entry->err = err;
+unlock:
+	spin_unlock(&async->lock);
+	mutex_unlock(&async->apply_lock);
 
-static DEVICE_ATTR_RO(fan1_input);
-static DEVICE_ATTR_RO(fan2_input);
+	return wait;
+}
 
-static void huawei_wmi_fan_speed_setup(struct device *dev)
+static void huawei_wmi_async_work(struct work_struct *work)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-	huawei->fan_speed_available = true;
-	if (huawei_wmi_fan_speed_get(0, NULL))
-	{
-		huawei->fan_speed_available = false;
-		return;
+	struct huawei_wmi *huawei = container_of(to_delayed_work(work),
+			struct huawei_wmi, async.work);
+	struct huawei_wmi_async *async = &huawei->async;
+	u64 wait, next = 0;
+	int i;
+
+	for (i = 0; i < HWMI_ASYNC_MAX; i++) {
+		wait = huawei_wmi_async_run(huawei, i, false);
+		if (wait)
+			next = next ? min(next, wait) : wait;
 	}
 
-	device_create_file(huawei->hwmon, &dev_attr_fan1_input);
-	device_create_file(huawei->hwmon, &dev_attr_fan2_input);
+	if (next)
+		queue_delayed_work(huawei_wmi_wq, &async->work,
+				nsecs_to_jiffies(next) + 1);
 }
 
-static void huawei_wmi_fan_speed_exit(struct device *dev)
+/* Queues a write, overwriting a write of the same slot that wasn't applied
+ * yet. A HWMI_ASYNC_KEEP value keeps the one already pending.
+ */
+static void huawei_wmi_async_queue(struct huawei_wmi *huawei, int slot, int v0, int v1)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct huawei_wmi_async *async = &huawei->async;
+	struct huawei_wmi_async_slot *entry = &async->slots[slot];
 
-	if (huawei->fan_speed_available)
-	{
-		device_remove_file(huawei->hwmon, &dev_attr_fan1_input);
-		device_remove_file(huawei->hwmon, &dev_attr_fan2_input);
+	spin_lock(&async->lock);
+	if (entry->pending) {
+		async->coalesced++;
+	} else {
+		entry->value[0] = entry->value[1] = HWMI_ASYNC_KEEP;
+		entry->pending = true;
 	}
+	if (v0 != HWMI_ASYNC_KEEP)
+		entry->value[0] = v0;
+	if (v1 != HWMI_ASYNC_KEEP)
+		entry->value[1] = v1;
+	async->queued++;
+	spin_unlock(&async->lock);
+
+	mod_delayed_work(huawei_wmi_wq, &async->work, 0);
 }
 
-/* Temp */
-/*
- * HVY-WXX9 and WRT-WX9 have more temp zone
- *
- * 0x00 CTMP cpu     TP00
- * 0x01              TP01
- * 0x05 TSLO         TP08
- * 0x06              TP06
- * 0x07 TNTC         TP02
- * 0x08 CNTC         TP03
- * 0x0B DNTC         TP05
- * 0x0E BTMP battery BTEM
- * 0x0F              TP0C
- * 0x15              TP07
- * 0x16              TP04
+/* Writes a sysfs store of slot, through the queue if async_write is set or
+ * huawei_wmi_async_throttle() says so. A direct write holds apply_lock so a
+ * queued write being applied can't land after it.
  */
+static int huawei_wmi_async_write(struct huawei_wmi *huawei, int slot,
+		int v0, int v1)
+{
+	struct huawei_wmi_async *async = &huawei->async;
+	int value[2] = { v0, v1 };
+	int err = 0;
+
+	if (async_write) {
+		huawei_wmi_async_queue(huawei, slot, v0, v1);
+		return 0;
+	}
+
+	mutex_lock(&async->apply_lock);
+	if (huawei_wmi_async_throttle(huawei, slot))
+		huawei_wmi_async_queue(huawei, slot, v0, v1);
+	else
+		err = huawei_wmi_async_apply(huawei, slot, value);
+	mutex_unlock(&async->apply_lock);
+
+	return err;
+}
 
-static int huawei_wmi_temp_get(u8 num, int *temp)
+/* Makes sure the pending write of slot was applied, budget or not, so reads
+ * see it. Returns, once, the error of the last write.
+ */
+static int huawei_wmi_async_sync(struct huawei_wmi *huawei, int slot)
 {
-	u8 ret[HWMI_BUFF_SIZE] = { 0 };
+	struct huawei_wmi_async *async = &huawei->async;
 	int err;
 
-	union hwmi_arg arg;
-	arg.cmd = TEMP_GET;
-	arg.args[2] = num;
-
-	err = huawei_wmi_cmd(arg.cmd, ret, HWMI_BUFF_SIZE);
-	if (err)
-		return err;
+	huawei_wmi_async_run(huawei, slot, true);
 
-	if (temp)
-		*temp = ret[2];
+	spin_lock(&async->lock);
+	err = async->slots[slot].err;
+	async->slots[slot].err = 0;
+	spin_unlock(&async->lock);
 
-	return 0;
+	return err;
 }
 
-#define CREATE_TEMP_ATTR(_idxA, _idxB, _idxC)                   \
+/* LEDs */
+
+static int huawei_wmi_micmute_led_set(struct led_classdev *led_cdev,
+		enum led_brightness brightness)
+{
+	struct huawei_wmi *huawei = container_of(led_cdev, struct huawei_wmi, micmute_cdev);
+
+	/* This is a workaround until the "legacy" interface is implemented. */
+	if (quirks && quirks->ec_micmute) {
+		char *acpi_method;
+		acpi_handle handle;
+		acpi_status status;
+		union acpi_object args[3];
+		struct acpi_object_list arg_list = {
+			.pointer = args,
+			.count = ARRAY_SIZE(args),
+		};
+
+		handle = huawei->caps.ec;
+		if (!handle)
+			return -ENODEV;
+
+		args[0].type = args[1].type = args[2].type = ACPI_TYPE_INTEGER;
+		args[1].integer.value = 0x04;
+
+		if (huawei_wmi_has_method(huawei, HWMI_CAP_SPIN)) {
+			acpi_method = "SPIN";
+			args[0].integer.value = 0;
+			args[2].integer.value = brightness ? 1 : 0;
+		} else if (huawei_wmi_has_method(huawei, HWMI_CAP_WPIN)) {
+			acpi_method = "WPIN";
+			args[0].integer.value = 1;
+			args[2].integer.value = brightness ? 0 : 1;
+		} else {
+			return -ENODEV;
+		}
+
+		status = acpi_evaluate_object(handle, acpi_method, &arg_list, NULL);
+		if (ACPI_FAILURE(status))
+			return -ENODEV;
+
+		return 0;
+	} else {
+		union hwmi_arg arg;
+
+		arg.cmd = MICMUTE_LED_SET;
+		arg.args[2] = brightness;
+
+		return huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	}
+}
+
+static int __huawei_wmi_kbdlight_set_auto(struct huawei_wmi *huawei,
+		int level, int prio);
+
+static int huawei_wmi_kbdlight_led_set(struct led_classdev *led_cdev,
+		enum led_brightness brightness)
+{
+	struct huawei_wmi *huawei = container_of(led_cdev, struct huawei_wmi, kbdlight_cdev);
+
+	return __huawei_wmi_kbdlight_set_auto(huawei, brightness, HWMI_PRIO_INTERACTIVE);
+}
+
+static void huawei_wmi_leds_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	huawei->micmute_cdev.name = "huawei::micmute";
+	huawei->micmute_cdev.max_brightness = 1;
+	huawei->micmute_cdev.brightness_set_blocking = &huawei_wmi_micmute_led_set;
+	huawei->micmute_cdev.default_trigger = "audio-micmute";
+	huawei->micmute_cdev.dev = dev;
+	huawei->micmute_cdev.flags = LED_CORE_SUSPENDRESUME;
+
+	if (huawei_wmi_has_method(huawei, HWMI_CAP_SMLS) ||
+			(quirks && quirks->ec_micmute))
+		devm_led_classdev_register(dev, &huawei->micmute_cdev);
+
+	huawei->kbdlight_cdev.name = "huawei::kbd_backlight";
+	huawei->kbdlight_cdev.max_brightness = 100;
+	huawei->kbdlight_cdev.brightness_set_blocking = &huawei_wmi_kbdlight_led_set;
+	huawei->kbdlight_cdev.dev = dev;
+
+	if (huawei_wmi_has_method(huawei, HWMI_CAP_SKBL) ||
+			(quirks && quirks->kbdlight_auto))
+		devm_led_classdev_register(dev, &huawei->kbdlight_cdev);
+}
+
+/* Battery protection */
+
+struct hwmi_battery {
+	int *start;
+	int *end;
+};
+
+static void huawei_wmi_battery_decode(const u8 *ret, size_t len, void *ctx)
+{
+	struct hwmi_battery *battery = ctx;
+	int i;
+
+	if (len < 3)
+		return;
+
+	/* Find the last two non-zero values. Return status is ignored. */
+	i = len - 1;
+	do {
+		if (battery->start)
+			*battery->start = ret[i-1];
+		if (battery->end)
+			*battery->end = ret[i];
+	} while (i > 2 && !ret[i--]);
+}
+
+static int huawei_wmi_battery_get(struct huawei_wmi *huawei, int *start, int *end)
+{
+	int val[2] = { 0 }, err;
+	struct hwmi_battery battery = { &val[0], &val[1] };
+
+	if (huawei_wmi_snap_get(huawei, HWMI_SNAP_BATTERY,
+			HWMI_STATE_BATTERY_START, val, 2))
+		goto out;
+
+	err = huawei_wmi_cmd_decode(huawei, BATTERY_THRESH_GET,
+			huawei_wmi_battery_decode, &battery);
+	if (err)
+		return err;
+	huawei_wmi_snap_put(huawei, HWMI_STATE_BATTERY_START, val, 2);
+
+out:
+	if (start)
+		*start = val[0];
+	if (end)
+		*end = val[1];
+	return 0;
+}
+
+/* Fills a zeroed batch of (at least) 2 entries with the commands needed to
+ * set the thresholds and returns their count.
+ */
+static int huawei_wmi_battery_prepare(struct hwmi_batch *batch,
+		int start, int end)
+{
+	int n = 0;
+
+	if (start < 0 || end < 0 || start > 100 || end > 100)
+		return -EINVAL;
+
+	/* This is an edge case were some models turn battery protection
+	 * off without changing their thresholds values. We clear the
+	 * values before turning off protection. Sometimes we need a sleep delay to
+	 * make sure these values make their way to EC memory.
+	 */
+	if (quirks && quirks->battery_reset && start == 0 && end == 100) {
+		batch[n].arg.cmd = BATTERY_THRESH_SET;
+		batch[n].delay_ms = 1000;
+		n++;
+	}
+
+	batch[n].arg.cmd = BATTERY_THRESH_SET;
+	batch[n].arg.args[2] = start;
+	batch[n].arg.args[3] = end;
+	n++;
+
+	return n;
+}
+
+static int huawei_wmi_battery_set(struct huawei_wmi *huawei, int start, int end)
+{
+	struct hwmi_batch batch[2] = { };
+	int val[2] = { start, end };
+	int err, n;
+
+	n = huawei_wmi_battery_prepare(batch, start, end);
+	if (n < 0)
+		return n;
+
+	err = huawei_wmi_cmd_batch(huawei, batch, n, true, HWMI_PRIO_CONTROL);
+	if (err)
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_BATTERY_START, 2);
+	else
+		huawei_wmi_snap_put(huawei, HWMI_STATE_BATTERY_START, val, 2);
+
+	return err;
+}
+
+/* Read-modify-write of the thresholds under a single wmi_lock hold. A NULL
+ * start or end keeps the current value.
+ */
+static int huawei_wmi_battery_update(struct huawei_wmi *huawei,
+		const int *start, const int *end)
+{
+	struct hwmi_batch batch[2] = { };
+	int err, cur_start = 0, cur_end = 0, n;
+	struct hwmi_battery battery = { &cur_start, &cur_end };
+
+	huawei_wmi_lock(huawei, HWMI_PRIO_CONTROL, 0);
+	err = __huawei_wmi_cmd_decode(huawei, BATTERY_THRESH_GET,
+			huawei_wmi_battery_decode, &battery);
+	if (err)
+		goto out;
+
+	if (start)
+		cur_start = *start;
+	if (end)
+		cur_end = *end;
+	n = huawei_wmi_battery_prepare(batch, cur_start, cur_end);
+	if (n < 0) {
+		err = n;
+		goto out;
+	}
+
+	err = __huawei_wmi_cmd_batch(huawei, batch, n, true);
+	if (err) {
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_BATTERY_START, 2);
+	} else {
+		int val[2] = { cur_start, cur_end };
+
+		huawei_wmi_snap_put(huawei, HWMI_STATE_BATTERY_START, val, 2);
+	}
+
+out:
+	huawei_wmi_unlock(huawei);
+	return err;
+}
+
+static ssize_t charge_control_start_threshold_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = huawei_wmi_method;
+	int err, start;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_BATTERY);
+	if (err)
+		return err;
+
+	err = huawei_wmi_battery_get(huawei, &start, NULL);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", start);
+}
+
+static ssize_t charge_control_end_threshold_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = huawei_wmi_method;
+	int err, end;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_BATTERY);
+	if (err)
+		return err;
+
+	err = huawei_wmi_battery_get(huawei, NULL, &end);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", end);
+}
+
+static ssize_t charge_control_thresholds_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, start, end;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_BATTERY);
+	if (err)
+		return err;
+
+	err = huawei_wmi_battery_get(huawei, &start, &end);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d %d\n", start, end);
+}
+
+static ssize_t charge_control_start_threshold_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = huawei_wmi_method;
+	int err, start;
+
+	if (sscanf(buf, "%d", &start) != 1)
+		return -EINVAL;
+
+	if (start < 0 || start > 100)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_BATTERY, start,
+			HWMI_ASYNC_KEEP);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static ssize_t charge_control_end_threshold_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = huawei_wmi_method;
+	int err, end;
+
+	if (sscanf(buf, "%d", &end) != 1)
+		return -EINVAL;
+
+	if (end < 0 || end > 100)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_BATTERY,
+			HWMI_ASYNC_KEEP, end);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static ssize_t charge_control_thresholds_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, start, end;
+
+	if (sscanf(buf, "%d %d", &start, &end) != 2)
+		return -EINVAL;
+
+	if (start < 0 || end < 0 || start > 100 || end > 100)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_BATTERY, start, end);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(charge_control_start_threshold);
+static DEVICE_ATTR_RW(charge_control_end_threshold);
+static DEVICE_ATTR_RW(charge_control_thresholds);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static int huawei_wmi_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
+#else
+static int huawei_wmi_battery_add(struct power_supply *battery)
+#endif
+{
+	device_create_file(&battery->dev, &dev_attr_charge_control_start_threshold);
+	device_create_file(&battery->dev, &dev_attr_charge_control_end_threshold);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static int huawei_wmi_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
+#else
+static int huawei_wmi_battery_remove(struct power_supply *battery)
+#endif
+{
+	device_remove_file(&battery->dev, &dev_attr_charge_control_start_threshold);
+	device_remove_file(&battery->dev, &dev_attr_charge_control_end_threshold);
+
+	return 0;
+}
+
+static struct acpi_battery_hook huawei_wmi_battery_hook = {
+	.add_battery = huawei_wmi_battery_add,
+	.remove_battery = huawei_wmi_battery_remove,
+	.name = "Huawei Battery Extension"
+};
+
+static void huawei_wmi_battery_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_battery_get(huawei, NULL, NULL))
+		return;
+	smp_store_release(&huawei->battery_available, true);
+
+	battery_hook_register(&huawei_wmi_battery_hook);
+	device_create_file(dev, &dev_attr_charge_control_thresholds);
+}
+
+static void huawei_wmi_battery_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->battery_available) {
+		battery_hook_unregister(&huawei_wmi_battery_hook);
+		device_remove_file(dev, &dev_attr_charge_control_thresholds);
+	}
+}
+
+/* Smart charge param*/
+
+static int huawei_wmi_smart_charge_param_get(struct huawei_wmi *huawei, int *value)
+{
+	u8 ret[2];
+	int err;
+
+	err = huawei_wmi_cmd(huawei, BATTERY_CHARGE_MODE_PARAM_GET, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	if (value)
+		*value = ret[1];
+
+	return 0;
+}
+
+static int huawei_wmi_smart_charge_param_set(struct huawei_wmi *huawei, int value)
+{
+	union hwmi_arg arg;
+	int err;
+
+	if (value < 0 || value > 2)
+		return -EINVAL;
+
+	arg.cmd = BATTERY_CHARGE_MODE_PARAM_SET;
+	arg.args[2] = (u8) value;
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	return err;
+}
+
+static ssize_t smart_charge_param_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, value;
+
+	err = huawei_wmi_smart_charge_param_get(huawei, &value);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", value);
+}
+
+static ssize_t smart_charge_param_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, value;
+
+	if (sscanf(buf, "%d", &value) != 1)
+		return -EINVAL;
+
+	err = huawei_wmi_smart_charge_param_set(huawei, value);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(smart_charge_param);
+
+static void huawei_wmi_smart_charge_param_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_smart_charge_param_get(huawei, NULL))
+		return;
+	smp_store_release(&huawei->smart_charge_param_available, true);
+
+	device_create_file(dev, &dev_attr_smart_charge_param);
+}
+
+static void huawei_wmi_smart_charge_param_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->smart_charge_param_available) {
+		device_remove_file(dev, &dev_attr_smart_charge_param);
+	}
+}
+
+/* Smart charge */
+
+static int huawei_wmi_smart_charge_get(struct huawei_wmi *huawei,
+		int *mode, int *unknow, int *start, int *end)
+{
+	u8 ret[5];
+	int err;
+
+	err = huawei_wmi_cmd(huawei, BATTERY_CHARGE_MODE_GET, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	if (mode)
+		*mode = ret[1];
+	if (unknow)
+		*unknow = ret[2];
+	if (start)
+		*start = ret[3];
+	if (end)
+		*end = ret[4];
+
+	return 0;
+}
+
+static int huawei_wmi_smart_charge_set(struct huawei_wmi *huawei,
+		int mode, int unknow, int start, int end)
+{
+	union hwmi_arg arg;
+	int err;
+
+	if (start < 0 || end < 0 || start > 100 || end > 100)
+		return -EINVAL;
+
+	arg.cmd = BATTERY_CHARGE_MODE_SET;
+	arg.args[2] = (u8) mode;
+	arg.args[3] = (u8) unknow;
+	arg.args[4] = (u8) start;
+	arg.args[5] = (u8) end;
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	/* The charge mode carries the thresholds too. */
+	huawei_wmi_snap_forget(huawei, HWMI_STATE_BATTERY_START, 2);
+	return err;
+}
+
+static ssize_t smart_charge_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, start, end, mode, unknow;
+
+	err = huawei_wmi_smart_charge_get(huawei, &mode, &unknow, &start, &end);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d %d %d %d\n", mode, unknow, start, end);
+}
+
+static ssize_t smart_charge_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, start, end, mode, unknow;
+
+	if (sscanf(buf, "%d %d %d %d", &mode, &unknow, &start, &end) != 4)
+		return -EINVAL;
+
+	err = huawei_wmi_smart_charge_set(huawei, mode, unknow, start, end);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(smart_charge);
+
+static void huawei_wmi_smart_charge_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_smart_charge_get(huawei, NULL, NULL, NULL, NULL))
+		return;
+	smp_store_release(&huawei->smart_charge_available, true);
+
+	device_create_file(dev, &dev_attr_smart_charge);
+}
+
+static void huawei_wmi_smart_charge_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->smart_charge_available) {
+		device_remove_file(dev, &dev_attr_smart_charge);
+	}
+}
+
+/* Fn lock */
+
+static void huawei_wmi_fn_lock_decode(const u8 *ret, size_t len, void *ctx)
+{
+	int *on = ctx;
+	int i;
+
+	/* Find the first non-zero value. Return status is ignored. */
+	i = 1;
+	do {
+		if (on)
+			*on = ret[i] - 1; // -1 undefined, 0 off, 1 on.
+	} while (i < len - 1 && !ret[i++]);
+}
+
+static int huawei_wmi_fn_lock_get(struct huawei_wmi *huawei, int *on)
+{
+	int val = -1, err;
+
+	if (huawei_wmi_snap_get(huawei, HWMI_SNAP_FN_LOCK,
+			HWMI_STATE_FN_LOCK, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd_decode(huawei, FN_LOCK_GET, huawei_wmi_fn_lock_decode, &val);
+	if (err)
+		return err;
+	huawei_wmi_snap_put(huawei, HWMI_STATE_FN_LOCK, &val, 1);
+
+out:
+	if (on)
+		*on = val;
+	return 0;
+}
+
+static int huawei_wmi_fn_lock_set(struct huawei_wmi *huawei, int on)
+{
+	union hwmi_arg arg;
+	int err;
+
+	arg.cmd = FN_LOCK_SET;
+	arg.args[2] = on + 1; // 0 undefined, 1 off, 2 on.
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	if (err)
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_FN_LOCK, 1);
+	else
+		huawei_wmi_snap_put(huawei, HWMI_STATE_FN_LOCK, &on, 1);
+
+	return err;
+}
+
+static ssize_t fn_lock_state_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, on;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_FN_LOCK);
+	if (err)
+		return err;
+
+	err = huawei_wmi_fn_lock_get(huawei, &on);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", on);
+}
+
+static ssize_t fn_lock_state_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int on, err;
+
+	if (kstrtoint(buf, 10, &on) ||
+			on < 0 || on > 1)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_FN_LOCK, on, 0);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(fn_lock_state);
+
+static void huawei_wmi_fn_lock_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_fn_lock_get(huawei, NULL))
+		return;
+	smp_store_release(&huawei->fn_lock_available, true);
+
+	device_create_file(dev, &dev_attr_fn_lock_state);
+}
+
+static void huawei_wmi_fn_lock_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->fn_lock_available)
+		device_remove_file(dev, &dev_attr_fn_lock_state);
+}
+
+/* Keyboard backlight */
+
+static int huawei_wmi_kbdlight_get(struct huawei_wmi *huawei, int *level)
+{
+	u8 ret[3] = { 0 };
+	int val = 0, err;
+
+	if (huawei_wmi_snap_get(huawei, HWMI_SNAP_KBDLIGHT,
+			HWMI_STATE_KBDLIGHT, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd(huawei, KBDLIGHT_GET, ret, sizeof(ret));
+	if (err)
+		return err;
+	if (!ret[2])
+		return -ENODEV;
+
+	/* Some models like the MACH-WX9 use 0x01, 0x02, and 0x04 for off, level 1,
+	 * and level 2 respectively rather than 0x04, 0x08, and 0x10.
+	 */
+	huawei->kbdlight_quirk_input = ret[1] == 0xff;
+
+	while (ret[2] >>= 1)
+		val += 1;
+	if (!huawei->kbdlight_quirk_input)
+		val -= 2;
+	huawei_wmi_snap_put(huawei, HWMI_STATE_KBDLIGHT, &val, 1);
+
+out:
+	if (level)
+		*level = val;
+	return 0;
+}
+
+static int __huawei_wmi_kbdlight_set(struct huawei_wmi *huawei, int level, int prio)
+{
+	union hwmi_arg arg;
+	int err;
+
+	// Huawei laptops only support 3 kbdlight levels
+	if (level < 0 || level > 2)
+		return -EINVAL;
+
+	arg.cmd = KBDLIGHT_SET;
+	arg.args[2] = 1 << (huawei->kbdlight_quirk_input ? level : level + 2);
+
+	err = huawei_wmi_cmd_prio(huawei, arg.cmd, NULL, 0, prio);
+	if (err)
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_KBDLIGHT, 1);
+	else
+		huawei_wmi_snap_put(huawei, HWMI_STATE_KBDLIGHT, &level, 1);
+
+	return err;
+}
+
+static int huawei_wmi_kbdlight_set(struct huawei_wmi *huawei, int level)
+{
+	return __huawei_wmi_kbdlight_set(huawei, level, HWMI_PRIO_CONTROL);
+}
+
+static int __huawei_wmi_kbdlight_set_auto(struct huawei_wmi *huawei,
+		int level, int prio)
+{
+	struct hwmi_batch batch[2] = { };
+
+	if (level < 0 || level > 255)
+		return -EINVAL;
+
+	batch[0].arg.cmd = KBDLIGHT_MODE_SET;
+	batch[0].arg.args[2] = KBDLIGHT_MODE_AUTO;
+	batch[0].delay_ms = 10;
+
+	batch[1].arg.cmd = KBDLIGHT_SET_AUTO;
+	batch[1].arg.args[2] = level;
+
+	huawei_wmi_cmd_batch(huawei, batch, ARRAY_SIZE(batch), false, prio);
+
+	/* Auto levels don't map to the ones KBDLIGHT_GET reports. */
+	huawei_wmi_snap_forget(huawei, HWMI_STATE_KBDLIGHT, 1);
+
+	return batch[1].err;
+}
+
+static int huawei_wmi_kbdlight_set_auto(struct huawei_wmi *huawei, int level)
+{
+	return __huawei_wmi_kbdlight_set_auto(huawei, level, HWMI_PRIO_CONTROL);
+}
+
+static ssize_t kbdlight_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, level;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_KBDLIGHT);
+	if (err)
+		return err;
+
+	err = huawei_wmi_kbdlight_get(huawei, &level);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", level);
+}
+
+static ssize_t kbdlight_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int level, err;
+
+	if (kstrtoint(buf, 10, &level))
+		return -EINVAL;
+
+	if (level < 0 || level > (quirks && quirks->kbdlight_auto ? 255 : 2))
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_KBDLIGHT, level, 0);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(kbdlight);
+
+static void huawei_wmi_kbdlight_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (!(huawei_wmi_has_method(huawei, HWMI_CAP_SKBL) ||
+			(quirks && quirks->kbdlight_auto))
+	    && huawei_wmi_kbdlight_get(huawei, NULL))
+		return;
+	smp_store_release(&huawei->kbdlight_available, true);
+
+	device_create_file(dev, &dev_attr_kbdlight);
+}
+
+static void huawei_wmi_kbdlight_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->kbdlight_available)
+		device_remove_file(dev, &dev_attr_kbdlight);
+}
+
+/* Keyboard backlight timeout */
+
+static int huawei_wmi_kbdlight_timeout_get(struct huawei_wmi *huawei, int *seconds)
+{
+	u8 ret[3] = { 0 };
+	int val, err;
+
+	if (huawei_wmi_snap_get(huawei, HWMI_SNAP_KBDLIGHT_TIMEOUT,
+			HWMI_STATE_KBDLIGHT_TIMEOUT, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd(huawei, KBDLIGHT_TIMEOUT_GET, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	val = ret[1] | (ret[2] << 8);
+	huawei_wmi_snap_put(huawei, HWMI_STATE_KBDLIGHT_TIMEOUT, &val, 1);
+
+out:
+	if (seconds)
+		*seconds = val;
+	return 0;
+}
+
+static int huawei_wmi_kbdlight_timeout_set(struct huawei_wmi *huawei, int seconds)
+{
+	union hwmi_arg arg;
+	int err;
+
+	arg.cmd = KBDLIGHT_TIMEOUT_SET;
+	arg.args[2] = (seconds & 0xff);
+	arg.args[3] = (seconds >> 8);
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	if (err)
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_KBDLIGHT_TIMEOUT, 1);
+	else
+		huawei_wmi_snap_put(huawei, HWMI_STATE_KBDLIGHT_TIMEOUT, &seconds, 1);
+
+	return err;
+}
+
+static ssize_t kbdlight_timeout_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, seconds;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_KBDLIGHT_TIMEOUT);
+	if (err)
+		return err;
+
+	err = huawei_wmi_kbdlight_timeout_get(huawei, &seconds);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", seconds);
+}
+
+static ssize_t kbdlight_timeout_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int seconds, err;
+
+	if (kstrtoint(buf, 10, &seconds) ||
+			seconds < 0 || seconds > 0xffff)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_KBDLIGHT_TIMEOUT,
+			seconds, 0);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(kbdlight_timeout);
+
+static void huawei_wmi_kbdlight_timeout_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	if (huawei_wmi_kbdlight_timeout_get(huawei, NULL))
+		return;
+	smp_store_release(&huawei->kbdlight_timeout_available, true);
+
+	device_create_file(dev, &dev_attr_kbdlight_timeout);
+}
+
+static void huawei_wmi_kbdlight_timeout_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->kbdlight_timeout_available)
+		device_remove_file(dev, &dev_attr_kbdlight_timeout);
+}
+
+/* Power unlock */
+
+static int huawei_wmi_power_unlock_get(struct huawei_wmi *huawei, int *on)
+{
+	u8 ret[2] = { 0 };
+	int val, err;
+
+	if (huawei_wmi_snap_get(huawei, HWMI_SNAP_POWER_UNLOCK,
+			HWMI_STATE_POWER_UNLOCK, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd(huawei, POWER_UNLOCK_GET, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	val = ret[1];
+	huawei_wmi_snap_put(huawei, HWMI_STATE_POWER_UNLOCK, &val, 1);
+
+out:
+	if (on)
+		*on = val;
+	return 0;
+}
+
+static int huawei_wmi_power_unlock_set(struct huawei_wmi *huawei, int on)
+{
+	union hwmi_arg arg;
+	int err;
+
+	arg.cmd = POWER_UNLOCK_SET;
+	arg.args[2] = on;
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, NULL, 0);
+	if (err)
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_POWER_UNLOCK, 1);
+	else
+		huawei_wmi_snap_put(huawei, HWMI_STATE_POWER_UNLOCK, &on, 1);
+
+	return err;
+}
+
+static ssize_t power_unlock_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, on;
+
+	err = huawei_wmi_async_sync(huawei, HWMI_ASYNC_POWER_UNLOCK);
+	if (err)
+		return err;
+
+	err = huawei_wmi_power_unlock_get(huawei, &on);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", on);
+}
+
+static ssize_t power_unlock_store(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t size)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int on, err;
+
+	if (kstrtoint(buf, 10, &on) ||
+			on < 0 || on > 1)
+		return -EINVAL;
+
+	err = huawei_wmi_async_write(huawei, HWMI_ASYNC_POWER_UNLOCK, on, 0);
+	if (err)
+		return err;
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(power_unlock);
+
+static void huawei_wmi_power_unlock_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	if (huawei_wmi_power_unlock_get(huawei, NULL))
+		return;
+	smp_store_release(&huawei->power_unlock_available, true);
+
+	device_create_file(dev, &dev_attr_power_unlock);
+}
+
+static void huawei_wmi_power_unlock_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->power_unlock_available)
+		device_remove_file(dev, &dev_attr_power_unlock);
+}
+
+/* Writes value to the EC, for huawei_wmi_async_write() and the queue. */
+static int huawei_wmi_async_apply(struct huawei_wmi *huawei, int slot,
+		const int *value)
+{
+	switch (slot) {
+	case HWMI_ASYNC_KBDLIGHT:
+		if (quirks && quirks->kbdlight_auto)
+			return huawei_wmi_kbdlight_set_auto(huawei, value[0]);
+		return huawei_wmi_kbdlight_set(huawei, value[0]);
+	case HWMI_ASYNC_KBDLIGHT_TIMEOUT:
+		return huawei_wmi_kbdlight_timeout_set(huawei, value[0]);
+	case HWMI_ASYNC_FN_LOCK:
+		return huawei_wmi_fn_lock_set(huawei, value[0]);
+	case HWMI_ASYNC_POWER_UNLOCK:
+		return huawei_wmi_power_unlock_set(huawei, value[0]);
+	case HWMI_ASYNC_BATTERY:
+		if (value[0] != HWMI_ASYNC_KEEP && value[1] != HWMI_ASYNC_KEEP)
+			return huawei_wmi_battery_set(huawei, value[0], value[1]);
+		return huawei_wmi_battery_update(huawei, 
+				value[0] != HWMI_ASYNC_KEEP ? &value[0] : NULL,
+				value[1] != HWMI_ASYNC_KEEP ? &value[1] : NULL);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Hwmon subdriver */
+
+/* Fan speed */
+
+static int huawei_wmi_fan_speed_get(struct huawei_wmi *huawei, u8 num, int *rpm)
+{
+	u8 ret[3] = { 0 };
+	int val, err;
+
+	union hwmi_arg arg;
+	arg.cmd = FAN_SPEED_GET;
+	arg.args[2] = num;
+
+	if (num < 2 && huawei_wmi_snap_get(huawei, HWMI_SNAP_FAN,
+			HWMI_STATE_FAN + num, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	val = ret[1] | (ret[2] << 8);
+	if (num < 2)
+		huawei_wmi_snap_put(huawei, HWMI_STATE_FAN + num, &val, 1);
+
+out:
+	if (rpm)
+		*rpm = val;
+	return 0;
+}
+
+static ssize_t fan1_input_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, rpm;
+
+	err = huawei_wmi_fan_speed_get(huawei, 0, &rpm);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", rpm);
+}
+
+static ssize_t fan2_input_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	int err, rpm;
+
+	err = huawei_wmi_fan_speed_get(huawei, 1, &rpm);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", rpm);
+}
+
+static DEVICE_ATTR_RO(fan1_input);
+static DEVICE_ATTR_RO(fan2_input);
+
+static void huawei_wmi_fan_speed_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_fan_speed_get(huawei, 0, NULL))
+		return;
+	smp_store_release(&huawei->fan_speed_available, true);
+
+	device_create_file(huawei->hwmon, &dev_attr_fan1_input);
+	device_create_file(huawei->hwmon, &dev_attr_fan2_input);
+}
+
+static void huawei_wmi_fan_speed_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->fan_speed_available)
+	{
+		device_remove_file(huawei->hwmon, &dev_attr_fan1_input);
+		device_remove_file(huawei->hwmon, &dev_attr_fan2_input);
+	}
+}
+
+/* Temp */
+/*
+ * HVY-WXX9 and WRT-WX9 have more temp zone
+ *
+ * 0x00 CTMP cpu     TP00
+ * 0x01              TP01
+ * 0x05 TSLO         TP08
+ * 0x06              TP06
+ * 0x07 TNTC         TP02
+ * 0x08 CNTC         TP03
+ * 0x0B DNTC         TP05
+ * 0x0E BTMP battery BTEM
+ * 0x0F              TP0C
+ * 0x15              TP07
+ * 0x16              TP04
+ */
+
+static int huawei_wmi_temp_get(struct huawei_wmi *huawei, u8 num, int *temp)
+{
+	u8 ret[3] = { 0 };
+	int val, err;
+
+	union hwmi_arg arg;
+	arg.cmd = TEMP_GET;
+	arg.args[2] = num;
+
+	if (num < 0x20 && huawei_wmi_snap_get(huawei, HWMI_SNAP_TEMP,
+			HWMI_STATE_TEMP + num, &val, 1))
+		goto out;
+
+	err = huawei_wmi_cmd(huawei, arg.cmd, ret, sizeof(ret));
+	if (err)
+		return err;
+
+	val = ret[2];
+	if (num < 0x20)
+		huawei_wmi_snap_put(huawei, HWMI_STATE_TEMP + num, &val, 1);
+
+out:
+	if (temp)
+		*temp = val;
+	return 0;
+}
+
+#define CREATE_TEMP_ATTR(_idxA, _idxB, _idxC)                   \
 	static ssize_t temp##_idxA##_input_show(struct device *dev, \
 			struct device_attribute *attr,                      \
 			char *buf)                                          \
 	{                                                           \
+		struct huawei_wmi *huawei = dev_get_drvdata(dev);       \
 		int err, temp;                                          \
-		err = huawei_wmi_temp_get(_idxB, &temp);                \
+		err = huawei_wmi_temp_get(huawei, _idxB, &temp);        \
 		if (err)                                                \
 			return err;                                         \
 	                                                            \
@@ -1386,141 +4019,874 @@ static int huawei_wmi_temp_get(u8 num, int *temp)
 	                                                            \
 	static DEVICE_ATTR_RO(temp##_idxA##_label);                 \
 
-CREATE_TEMP_ATTR(1, 0x00, "cpu\n")
-CREATE_TEMP_ATTR(2, 0x01, "TP01\n")
-CREATE_TEMP_ATTR(3, 0x05, "TSLO\n")
-CREATE_TEMP_ATTR(4, 0x06, "TP06\n")
-CREATE_TEMP_ATTR(5, 0x07, "TNTC\n")
-CREATE_TEMP_ATTR(6, 0x08, "CNTC\n")
-CREATE_TEMP_ATTR(7, 0x0B, "DNTC\n")
-CREATE_TEMP_ATTR(8, 0x0E, "battery\n")
-CREATE_TEMP_ATTR(9, 0x0F, "TP0C\n")
-CREATE_TEMP_ATTR(10, 0x15, "TP07\n")
-CREATE_TEMP_ATTR(11, 0x16, "TP04\n")
+CREATE_TEMP_ATTR(1, 0x00, "cpu\n")
+CREATE_TEMP_ATTR(2, 0x01, "TP01\n")
+CREATE_TEMP_ATTR(3, 0x05, "TSLO\n")
+CREATE_TEMP_ATTR(4, 0x06, "TP06\n")
+CREATE_TEMP_ATTR(5, 0x07, "TNTC\n")
+CREATE_TEMP_ATTR(6, 0x08, "CNTC\n")
+CREATE_TEMP_ATTR(7, 0x0B, "DNTC\n")
+CREATE_TEMP_ATTR(8, 0x0E, "battery\n")
+CREATE_TEMP_ATTR(9, 0x0F, "TP0C\n")
+CREATE_TEMP_ATTR(10, 0x15, "TP07\n")
+CREATE_TEMP_ATTR(11, 0x16, "TP04\n")
+
+#define CREATE_TEMP_FILE(_idxA)                                       \
+	device_create_file(huawei->hwmon, &dev_attr_temp##_idxA##_input); \
+	device_create_file(huawei->hwmon, &dev_attr_temp##_idxA##_label); \
+
+#define REMOVE_TEMP_FILE(_idxA)                                       \
+	device_remove_file(huawei->hwmon, &dev_attr_temp##_idxA##_label); \
+	device_remove_file(huawei->hwmon, &dev_attr_temp##_idxA##_input); \
+
+static void huawei_wmi_temp_setup(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei_wmi_temp_get(huawei, 0, NULL))
+		return;
+	smp_store_release(&huawei->temp_available, true);
+
+	CREATE_TEMP_FILE(1)
+	CREATE_TEMP_FILE(2)
+	CREATE_TEMP_FILE(3)
+	CREATE_TEMP_FILE(4)
+	CREATE_TEMP_FILE(5)
+	CREATE_TEMP_FILE(6)
+	CREATE_TEMP_FILE(7)
+	CREATE_TEMP_FILE(8)
+	CREATE_TEMP_FILE(9)
+	CREATE_TEMP_FILE(10)
+	CREATE_TEMP_FILE(11)
+}
+
+static void huawei_wmi_temp_exit(struct device *dev)
+{
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	if (huawei->temp_available)
+	{
+		REMOVE_TEMP_FILE(1)
+		REMOVE_TEMP_FILE(2)
+		REMOVE_TEMP_FILE(3)
+		REMOVE_TEMP_FILE(4)
+		REMOVE_TEMP_FILE(5)
+		REMOVE_TEMP_FILE(6)
+		REMOVE_TEMP_FILE(7)
+		REMOVE_TEMP_FILE(8)
+		REMOVE_TEMP_FILE(9)
+		REMOVE_TEMP_FILE(10)
+		REMOVE_TEMP_FILE(11)
+	}
+}
+
+/* debugfs */
+
+static void huawei_wmi_debugfs_call_dump(struct seq_file *m, void *data,
+		union acpi_object *obj)
+{
+	struct huawei_wmi *huawei = m->private;
+	int i;
+
+	switch (obj->type) {
+	case ACPI_TYPE_INTEGER:
+		seq_printf(m, "0x%llx", obj->integer.value);
+		break;
+	case ACPI_TYPE_STRING:
+		seq_printf(m, "\"%.*s\"", obj->string.length, obj->string.pointer);
+		break;
+	case ACPI_TYPE_BUFFER:
+		seq_puts(m, "{");
+		for (i = 0; i < obj->buffer.length; i++) {
+			seq_printf(m, "0x%02x", obj->buffer.pointer[i]);
+			if (i < obj->buffer.length - 1)
+				seq_puts(m, ",");
+		}
+		seq_puts(m, "}");
+		break;
+	case ACPI_TYPE_PACKAGE:
+		seq_puts(m, "[");
+		for (i = 0; i < obj->package.count; i++) {
+			huawei_wmi_debugfs_call_dump(m, huawei, &obj->package.elements[i]);
+			if (i < obj->package.count - 1)
+				seq_puts(m, ",");
+		}
+		seq_puts(m, "]");
+		break;
+	default:
+		dev_err(huawei->dev, "Unexpected obj type, got %d\n", obj->type);
+		return;
+	}
+}
+
+static int huawei_wmi_debugfs_call_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_buffer in;
+	union acpi_object *obj;
+	int err;
+
+	in.length = sizeof(u64);
+	in.pointer = &huawei->debug.arg;
+
+	err = huawei_wmi_call(huawei, &in, &out);
+	/* Raw calls can change any state behind our back. */
+	huawei_wmi_cache_flush(huawei);
+	huawei_wmi_snap_forget(huawei, 0, HWMI_STATE_MAX);
+	if (err)
+		return err;
+
+	obj = out.pointer;
+	if (!obj) {
+		err = -EIO;
+		goto fail_debugfs_call;
+	}
+
+	huawei_wmi_debugfs_call_dump(m, huawei, obj);
+
+fail_debugfs_call:
+	kfree(out.pointer);
+	return err;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_call);
+
+static int huawei_wmi_debugfs_retry_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_cmd_entry *entry;
+	int i;
+
+	seq_puts(m, "cmd    mode   failed recovered retrying\n");
+
+	mutex_lock(&huawei->wmi_lock);
+	for (i = 0; i < huawei->cmds.count; i++) {
+		entry = &huawei->cmds.entries[i];
+		seq_printf(m, "0x%04x %-6s %6u %9u %s\n", entry->cmd,
+			hwmi_retry_modes[entry->mode], entry->failed,
+			entry->recovered,
+			huawei_wmi_retry_wanted(entry) ? "yes" : "no");
+	}
+	mutex_unlock(&huawei->wmi_lock);
+
+	return 0;
+}
+
+/* Takes "<cmd> <auto|always|never>". Setting a command back to auto discards
+ * what was learned about it.
+ */
+static ssize_t huawei_wmi_debugfs_retry_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file_inode(file)->i_private;
+	struct huawei_wmi_cmd_entry *entry;
+	char buf[32], mode[8];
+	unsigned int cmd;
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%x %7s", &cmd, mode) != 2 || cmd > 0xffff)
+		return -EINVAL;
+
+	ret = match_string(hwmi_retry_modes, ARRAY_SIZE(hwmi_retry_modes), mode);
+	if (ret < 0)
+		return ret;
+
+	huawei_wmi_debugfs_lock(huawei);
+	entry = huawei_wmi_cmd_entry(huawei, cmd);
+	if (entry) {
+		entry->mode = ret;
+		if (entry->mode == HWMI_RETRY_AUTO)
+			entry->failed = entry->recovered = 0;
+	}
+	huawei_wmi_unlock(huawei);
+
+	return entry ? count : -ENOSPC;
+}
+
+static int huawei_wmi_debugfs_retry_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, huawei_wmi_debugfs_retry_show, inode->i_private);
+}
+
+static const struct file_operations huawei_wmi_debugfs_retry_fops = {
+	.owner = THIS_MODULE,
+	.open = huawei_wmi_debugfs_retry_open,
+	.read = seq_read,
+	.write = huawei_wmi_debugfs_retry_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void huawei_wmi_debugfs_lat_dump(struct seq_file *m, u16 cmd,
+		const char *kind, const struct huawei_wmi_lat *lat)
+{
+	int i;
+
+	if (!lat->count)
+		return;
+
+	seq_printf(m, "0x%04x %-4s count %llu min %lluus max %lluus avg %lluus\n",
+		cmd, kind, lat->count, div_u64(lat->min, NSEC_PER_USEC),
+		div_u64(lat->max, NSEC_PER_USEC),
+		div64_u64(lat->sum, lat->count * NSEC_PER_USEC));
+
+	seq_puts(m, "      ");
+	for (i = 0; i < HWMI_LAT_BUCKETS; i++) {
+		if (lat->buckets[i])
+			seq_printf(m, " %luus:%u", i ? BIT(i) : 0, lat->buckets[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int huawei_wmi_debugfs_latency_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_cmd_entry *entry;
+	int i;
+
+	mutex_lock(&huawei->wmi_lock);
+	for (i = 0; i < huawei->cmds.count; i++) {
+		entry = &huawei->cmds.entries[i];
+		huawei_wmi_debugfs_lat_dump(m, entry->cmd, "wait", &entry->wait);
+		huawei_wmi_debugfs_lat_dump(m, entry->cmd, "eval", &entry->eval);
+	}
+	mutex_unlock(&huawei->wmi_lock);
+
+	return 0;
+}
+
+/* Any write resets the histograms. */
+static ssize_t huawei_wmi_debugfs_latency_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file_inode(file)->i_private;
+	struct huawei_wmi_cmd_entry *entry;
+	int i;
+
+	huawei_wmi_debugfs_lock(huawei);
+	for (i = 0; i < huawei->cmds.count; i++) {
+		entry = &huawei->cmds.entries[i];
+		memset(&entry->wait, 0, sizeof(entry->wait));
+		memset(&entry->eval, 0, sizeof(entry->eval));
+	}
+	huawei_wmi_unlock(huawei);
+
+	return count;
+}
+
+static int huawei_wmi_debugfs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, huawei_wmi_debugfs_latency_show, inode->i_private);
+}
+
+static const struct file_operations huawei_wmi_debugfs_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = huawei_wmi_debugfs_latency_open,
+	.read = seq_read,
+	.write = huawei_wmi_debugfs_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int huawei_wmi_debugfs_sched_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_sched_stats *stats;
+	int i;
+
+	seq_puts(m, "class        count wait_avg_us wait_max_us timeouts\n");
+
+	spin_lock(&huawei->sched.lock);
+	for (i = 0; i < HWMI_PRIO_MAX; i++) {
+		stats = &huawei->sched.stats[i];
+		seq_printf(m, "%-11s %6llu %11llu %11llu %8llu\n", hwmi_prio_names[i],
+			stats->count,
+			stats->count ? div64_u64(stats->wait_sum,
+				stats->count * NSEC_PER_USEC) : 0,
+			div_u64(stats->wait_max, NSEC_PER_USEC),
+			stats->timeouts);
+	}
+	spin_unlock(&huawei->sched.lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_sched);
+
+static void huawei_wmi_debugfs_slow_dump(struct seq_file *m,
+		const struct huawei_wmi_slow *slow, u64 duration)
+{
+	seq_printf(m, "%6d %-16s 0x%04llx 0x%016llx %8llu\n", slow->pid,
+		slow->comm, slow->arg & 0xffff, slow->arg,
+		div_u64(duration, NSEC_PER_MSEC));
+}
+
+/* Evaluations that took longer than slow_ms, oldest first, and the one still
+ * running if it already did.
+ */
+static int huawei_wmi_debugfs_slow_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_watchdog *wdog = &huawei->wdog;
+	u64 slow_ns, now = ktime_get_ns();
+	unsigned int i;
+
+	spin_lock(&wdog->lock);
+	slow_ns = (u64)wdog->slow_ms * NSEC_PER_MSEC;
+	seq_printf(m, "slow: %llu busy: %llu\n", wdog->slow, wdog->busy);
+	seq_puts(m, "   pid comm             cmd    arg                 time_ms\n");
+
+	i = wdog->next > HWMI_SLOW_LOG ? wdog->next - HWMI_SLOW_LOG : 0;
+	for (; i < wdog->next; i++) {
+		huawei_wmi_debugfs_slow_dump(m, &wdog->log[i % HWMI_SLOW_LOG],
+			wdog->log[i % HWMI_SLOW_LOG].duration);
+	}
+
+	if (wdog->slow_ms && wdog->start && now - wdog->start > slow_ns) {
+		seq_puts(m, "running:\n");
+		huawei_wmi_debugfs_slow_dump(m, &wdog->cur, now - wdog->start);
+	}
+	spin_unlock(&wdog->lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_slow);
+
+static const char * const hwmi_breaker_states[] = {
+	[HWMI_BREAKER_CLOSED] = "closed",
+	[HWMI_BREAKER_OPEN] = "open",
+	[HWMI_BREAKER_PROBE] = "probe",
+};
+
+static int huawei_wmi_debugfs_breaker_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_breaker *breaker = &huawei->breaker;
+	struct huawei_wmi_breaker_entry *entry;
+	long left;
+	int i;
+
+	spin_lock(&breaker->lock);
+	seq_printf(m, "trips: %llu rejected: %llu\n", breaker->trips,
+		breaker->rejected);
+	seq_puts(m, "arg                state  fails  err backoff_ms left_ms\n");
+	for (i = 0; i < HWMI_CMD_SIZE; i++) {
+		entry = &breaker->entries[i];
+		if (!entry->valid)
+			continue;
+
+		left = entry->state == HWMI_BREAKER_OPEN ?
+			(long)(entry->until - jiffies) : 0;
+		seq_printf(m, "0x%016llx %-6s %5u %4d %10u %7u\n", entry->arg,
+			hwmi_breaker_states[entry->state], entry->fails,
+			entry->err, entry->backoff_ms,
+			left > 0 ? jiffies_to_msecs(left) : 0);
+	}
+	spin_unlock(&breaker->lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_breaker);
+
+static const char * const hwmi_feat_names[] = {
+	[HWMI_FEAT_BATTERY] = "battery",
+	[HWMI_FEAT_HWMON] = "hwmon",
+	[HWMI_FEAT_KBDLIGHT] = "kbdlight",
+	[HWMI_FEAT_INPUT] = "input",
+	[HWMI_FEAT_DEBUGFS] = "debugfs",
+	[HWMI_FEAT_OTHER] = "other",
+};
+
+static const unsigned int hwmi_util_windows[] = { 1, 10, HWMI_UTIL_SECS };
+
+/* Sums up the secs full seconds before now of features [first, last). Caller
+ * must hold util->lock.
+ */
+static void huawei_wmi_util_window(struct huawei_wmi_util *util,
+		int first, int last, u64 now, unsigned int secs,
+		u64 *busy, u64 *calls)
+{
+	struct huawei_wmi_util_bucket *bucket;
+	u64 sec;
+	int feat;
+
+	for (feat = first; feat < last; feat++) {
+		for (sec = now > secs ? now - secs : 0; sec < now; sec++) {
+			bucket = &util->buckets[feat][sec % (HWMI_UTIL_SECS + 1)];
+			if (bucket->sec != sec)
+				continue;
+			*busy += bucket->busy;
+			*calls += bucket->calls;
+		}
+	}
+}
+
+static void huawei_wmi_debugfs_util_row(struct seq_file *m,
+		struct huawei_wmi_util *util, const char *name,
+		int first, int last, u64 now)
+{
+	u64 rates[ARRAY_SIZE(hwmi_util_windows)];
+	u64 busy = 0, calls = 0, pct;
+	u32 rem;
+	int feat, i;
+
+	for (feat = first; feat < last; feat++) {
+		busy += util->busy[feat];
+		calls += util->calls[feat];
+	}
+	seq_printf(m, "%-9s %8llu %9llu", name, calls,
+		div_u64(busy, NSEC_PER_MSEC));
+
+	for (i = 0; i < ARRAY_SIZE(hwmi_util_windows); i++) {
+		busy = calls = 0;
+		huawei_wmi_util_window(util, first, last, now,
+			hwmi_util_windows[i], &busy, &calls);
+
+		/* In hundredths of a percent */
+		pct = div_u64(busy, hwmi_util_windows[i] * (NSEC_PER_SEC / 10000));
+		pct = div_u64_rem(pct, 100, &rem);
+		seq_printf(m, " %6llu.%02u%%", pct, rem);
+
+		/* In tenths of calls per second */
+		rates[i] = div_u64(calls * 10, hwmi_util_windows[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hwmi_util_windows); i++) {
+		pct = div_u64_rem(rates[i], 10, &rem);
+		seq_printf(m, " %6llu.%u", pct, rem);
+	}
+	seq_putc(m, '\n');
+}
+
+/* Share of wall time the EC spent evaluating HWMI for each feature, and the
+ * rate of evaluations, over the last 1, 10 and 60 seconds.
+ */
+static int huawei_wmi_debugfs_util_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_util *util = &huawei->util;
+	u64 now = div_u64(ktime_get_ns(), NSEC_PER_SEC);
+	int feat;
+
+	seq_puts(m, "feature      calls   busy_ms    util_1s   util_10s   util_60s"
+		"  rate_1s rate_10s rate_60s\n");
+
+	spin_lock(&util->lock);
+	for (feat = 0; feat < HWMI_FEAT_MAX; feat++)
+		huawei_wmi_debugfs_util_row(m, util, hwmi_feat_names[feat],
+			feat, feat + 1, now);
+	huawei_wmi_debugfs_util_row(m, util, "total", 0, HWMI_FEAT_MAX, now);
+	spin_unlock(&util->lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_util);
+
+static int huawei_wmi_debugfs_throttle_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_async *async = &huawei->async;
+	struct huawei_wmi_async_slot *entry;
+	int i;
+
+	seq_puts(m, "slot              rate burst throttled pending\n");
+
+	spin_lock(&async->lock);
+	for (i = 0; i < HWMI_ASYNC_MAX; i++) {
+		entry = &async->slots[i];
+		seq_printf(m, "%-16s %5u %5u %9llu %7d\n", hwmi_async_names[i],
+			entry->rate, entry->burst, entry->throttled,
+			entry->pending);
+	}
+	spin_unlock(&async->lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_throttle);
+
+static int huawei_wmi_debugfs_counters_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	u64 sum[HWMI_STAT_MAX];
+	int i, s, cpu;
+
+	seq_puts(m, "cmd    name                     calls       ok   status      eio"
+		"  retries cache_hits\n");
+
+	for (i = 0; i < HWMI_STAT_CMDS; i++) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			for (s = 0; s < HWMI_STAT_MAX; s++)
+				sum[s] += per_cpu_ptr(huawei->stats, cpu)->count[i][s];
+		}
+		if (!sum[HWMI_STAT_CALLS])
+			continue;
+
+		if (i < ARRAY_SIZE(hwmi_cmd_names))
+			seq_printf(m, "0x%04x %-21s", hwmi_cmd_names[i].cmd,
+				hwmi_cmd_names[i].name);
+		else
+			seq_printf(m, "%-6s %-21s", "-", "other");
+		for (s = 0; s < HWMI_STAT_MAX; s++)
+			seq_printf(m, " %8llu", sum[s]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_counters);
+
+static int huawei_wmi_debugfs_lockstat_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_lockstat *ls = &huawei->lockstat;
+	struct huawei_wmi_lockstat_feat stat[HWMI_FEAT_MAX];
+	int feat;
+
+	spin_lock(&ls->lock);
+	memcpy(stat, ls->feat, sizeof(stat));
+	spin_unlock(&ls->lock);
+
+	seq_puts(m, "feature   acquired contended wait_total_us wait_max_us"
+		" hold_total_us hold_max_us\n");
+	for (feat = 0; feat < HWMI_FEAT_MAX; feat++)
+		seq_printf(m, "%-9s %8llu %9llu %13llu %11llu %13llu %11llu\n",
+			hwmi_feat_names[feat], stat[feat].acquired,
+			stat[feat].contended,
+			div_u64(stat[feat].wait_sum, NSEC_PER_USEC),
+			div_u64(stat[feat].wait_max, NSEC_PER_USEC),
+			div_u64(stat[feat].hold_sum, NSEC_PER_USEC),
+			div_u64(stat[feat].hold_max, NSEC_PER_USEC));
+
+	return 0;
+}
+
+/* Any write resets the counters. */
+static ssize_t huawei_wmi_debugfs_lockstat_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file_inode(file)->i_private;
+	struct huawei_wmi_lockstat *ls = &huawei->lockstat;
+
+	spin_lock(&ls->lock);
+	memset(ls->feat, 0, sizeof(ls->feat));
+	spin_unlock(&ls->lock);
+
+	return count;
+}
+
+static int huawei_wmi_debugfs_lockstat_open(struct inode *inode,
+		struct file *file)
+{
+	return single_open(file, huawei_wmi_debugfs_lockstat_show,
+		inode->i_private);
+}
+
+static const struct file_operations huawei_wmi_debugfs_lockstat_fops = {
+	.owner = THIS_MODULE,
+	.open = huawei_wmi_debugfs_lockstat_open,
+	.read = seq_read,
+	.write = huawei_wmi_debugfs_lockstat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int huawei_wmi_debugfs_snapshot_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_snapshot *snap = &huawei->snap;
+	DECLARE_BITMAP(valid, HWMI_STATE_MAX);
+	int val[HWMI_STATE_MAX];
+	unsigned int seq;
+	int i;
+
+	do {
+		seq = read_seqbegin(&snap->lock);
+		bitmap_copy(valid, snap->valid, HWMI_STATE_MAX);
+		memcpy(val, snap->val, sizeof(val));
+	} while (read_seqretry(&snap->lock, seq));
+
+	for (i = 0; i < HWMI_STATE_MAX; i++) {
+		if (!test_bit(i, valid))
+			continue;
+		if (i >= HWMI_STATE_TEMP)
+			seq_printf(m, "temp 0x%02x", i - HWMI_STATE_TEMP);
+		else if (i >= HWMI_STATE_FAN)
+			seq_printf(m, "fan %d", i - HWMI_STATE_FAN);
+		else if (i == HWMI_STATE_FN_LOCK)
+			seq_puts(m, "fn_lock");
+		else if (i == HWMI_STATE_KBDLIGHT)
+			seq_puts(m, "kbdlight");
+		else if (i == HWMI_STATE_KBDLIGHT_TIMEOUT)
+			seq_puts(m, "kbdlight_timeout");
+		else if (i == HWMI_STATE_POWER_UNLOCK)
+			seq_puts(m, "power_unlock");
+		else if (i == HWMI_STATE_BATTERY_START)
+			seq_puts(m, "battery_start");
+		else
+			seq_puts(m, "battery_end");
+		seq_printf(m, " %d\n", val[i]);
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_snapshot);
+
+static int huawei_wmi_debugfs_caps_show(struct seq_file *m, void *data)
+{
+	struct huawei_wmi *huawei = m->private;
+	struct huawei_wmi_caps_cmd *cmd;
+	int i, name;
+
+	seq_printf(m, "ec     %s\n", huawei->caps.ec ? "yes" : "no");
+	for (i = 0; i < HWMI_CAP_MAX; i++)
+		seq_printf(m, "%-6s %s\n", hwmi_cap_names[i],
+			huawei_wmi_has_method(huawei, i) ? "yes" : "no");
+
+	seq_puts(m, "\narg                name                  supported\n");
+	mutex_lock(&huawei->wmi_lock);
+	for (i = 0; i < huawei->caps.count; i++) {
+		cmd = &huawei->caps.cmds[i];
+		name = huawei_wmi_stat_index(cmd->arg);
+		seq_printf(m, "0x%016llx %-21s %s\n", cmd->arg,
+			name < ARRAY_SIZE(hwmi_cmd_names) ?
+			hwmi_cmd_names[name].name : "unknown",
+			cmd->missing ? "no" : "yes");
+	}
+	mutex_unlock(&huawei->wmi_lock);
+
+	return 0;
+}
+
+/* Any write forgets the arguments found missing, they get issued again. */
+static ssize_t huawei_wmi_debugfs_caps_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file_inode(file)->i_private;
+	struct huawei_wmi_caps *caps = &huawei->caps;
+	int i, n;
+
+	huawei_wmi_debugfs_lock(huawei);
+	for (i = 0, n = 0; i < caps->count; i++) {
+		if (!caps->cmds[i].missing)
+			caps->cmds[n++] = caps->cmds[i];
+	}
+	caps->count = n;
+	huawei_wmi_unlock(huawei);
+
+	return count;
+}
+
+static int huawei_wmi_debugfs_caps_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, huawei_wmi_debugfs_caps_show, inode->i_private);
+}
+
+static const struct file_operations huawei_wmi_debugfs_caps_fops = {
+	.owner = THIS_MODULE,
+	.open = huawei_wmi_debugfs_caps_open,
+	.read = seq_read,
+	.write = huawei_wmi_debugfs_caps_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Streams the recorded commands as struct hwmi_rec, oldest first. Records
+ * overwritten before they could be read are skipped.
+ */
+static ssize_t huawei_wmi_debugfs_recorder_read(struct file *file,
+		char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file->private_data;
+	struct huawei_wmi_recorder *rec = &huawei->rec;
+	struct hwmi_rec r;
+	size_t done = 0;
+	u64 idx, head;
+
+	if (*ppos % sizeof(r))
+		return -EINVAL;
+
+	idx = *ppos / sizeof(r);
+	while (count - done >= sizeof(r)) {
+		head = smp_load_acquire(&rec->head);
+		if (idx >= head)
+			break;
+		if (head - idx > rec->size)
+			idx = head - rec->size;
+
+		r = rec->recs[idx & (rec->size - 1)];
+		smp_rmb();
+		if (READ_ONCE(rec->writing) > idx + rec->size) {
+			idx++;
+			continue;
+		}
+
+		if (copy_to_user(ubuf + done, &r, sizeof(r)))
+			return done ? done : -EFAULT;
+		done += sizeof(r);
+		idx++;
+	}
+
+	if (!done && count < sizeof(r))
+		return -EINVAL;
 
-#define CREATE_TEMP_FILE(_idxA)                                       \
-	device_create_file(huawei->hwmon, &dev_attr_temp##_idxA##_input); \
-	device_create_file(huawei->hwmon, &dev_attr_temp##_idxA##_label); \
+	*ppos = idx * sizeof(r);
+	return done;
+}
 
-#define REMOVE_TEMP_FILE(_idxA)                                       \
-	device_remove_file(huawei->hwmon, &dev_attr_temp##_idxA##_label); \
-	device_remove_file(huawei->hwmon, &dev_attr_temp##_idxA##_input); \
+static const struct file_operations huawei_wmi_debugfs_recorder_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = huawei_wmi_debugfs_recorder_read,
+	.llseek = default_llseek,
+};
 
-static void huawei_wmi_temp_setup(struct device *dev)
+static void huawei_wmi_fake_replay_stop(struct huawei_wmi *huawei)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
-	huawei->temp_available = true;
-	if (huawei_wmi_temp_get(0, NULL))
-	{
-		huawei->temp_available = false;
-		return;
-	}
-
-	CREATE_TEMP_FILE(1)
-	CREATE_TEMP_FILE(2)
-	CREATE_TEMP_FILE(3)
-	CREATE_TEMP_FILE(4)
-	CREATE_TEMP_FILE(5)
-	CREATE_TEMP_FILE(6)
-	CREATE_TEMP_FILE(7)
-	CREATE_TEMP_FILE(8)
-	CREATE_TEMP_FILE(9)
-	CREATE_TEMP_FILE(10)
-	CREATE_TEMP_FILE(11)
+	struct huawei_wmi_fake *fake = &huawei->fake;
+	unsigned int i;
+
+	mutex_lock(&fake->replay_lock);
+	for (i = 0; i < fake->replay_works_count; i++)
+		cancel_delayed_work_sync(&fake->replay_works[i].work);
+	kvfree(fake->replay_works);
+	fake->replay_works = NULL;
+	fake->replay_works_count = 0;
+	mutex_unlock(&fake->replay_lock);
 }
 
-static void huawei_wmi_temp_exit(struct device *dev)
+/* Loads a recording, as read from debugfs/huawei-wmi/recorder, for the fake
+ * EC to answer from. Writing at offset 0 replaces the current one.
+ */
+static ssize_t huawei_wmi_debugfs_replay_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct huawei_wmi *huawei = file->private_data;
+	struct huawei_wmi_fake *fake = &huawei->fake;
+	struct hwmi_rec *recs, *old;
+	unsigned int n, first;
 
-	if (huawei->temp_available)
-	{
-		REMOVE_TEMP_FILE(1)
-		REMOVE_TEMP_FILE(2)
-		REMOVE_TEMP_FILE(3)
-		REMOVE_TEMP_FILE(4)
-		REMOVE_TEMP_FILE(5)
-		REMOVE_TEMP_FILE(6)
-		REMOVE_TEMP_FILE(7)
-		REMOVE_TEMP_FILE(8)
-		REMOVE_TEMP_FILE(9)
-		REMOVE_TEMP_FILE(10)
-		REMOVE_TEMP_FILE(11)
+	if (*ppos % sizeof(*recs) || count % sizeof(*recs))
+		return -EINVAL;
+
+	first = *ppos ? fake->replay_count : 0;
+	n = count / sizeof(*recs);
+	if (!n)
+		return 0;
+	if (first + n > HWMI_REPLAY_MAX)
+		return -ENOSPC;
+
+	recs = kvcalloc(first + n, sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+	if (copy_from_user(recs + first, ubuf, count)) {
+		kvfree(recs);
+		return -EFAULT;
 	}
-}
 
-/* debugfs */
+	huawei_wmi_fake_replay_stop(huawei);
 
-static void huawei_wmi_debugfs_call_dump(struct seq_file *m, void *data,
-		union acpi_object *obj)
-{
-	struct huawei_wmi *huawei = m->private;
-	int i;
+	huawei_wmi_debugfs_lock(huawei);
+	if (first)
+		memcpy(recs, fake->replay, first * sizeof(*recs));
+	old = fake->replay;
+	fake->replay = recs;
+	fake->replay_count = first + n;
+	fake->replay_cursor = 0;
+	huawei_wmi_unlock(huawei);
+	kvfree(old);
 
-	switch (obj->type) {
-	case ACPI_TYPE_INTEGER:
-		seq_printf(m, "0x%llx", obj->integer.value);
-		break;
-	case ACPI_TYPE_STRING:
-		seq_printf(m, "\"%.*s\"", obj->string.length, obj->string.pointer);
-		break;
-	case ACPI_TYPE_BUFFER:
-		seq_puts(m, "{");
-		for (i = 0; i < obj->buffer.length; i++) {
-			seq_printf(m, "0x%02x", obj->buffer.pointer[i]);
-			if (i < obj->buffer.length - 1)
-				seq_puts(m, ",");
-		}
-		seq_puts(m, "}");
-		break;
-	case ACPI_TYPE_PACKAGE:
-		seq_puts(m, "[");
-		for (i = 0; i < obj->package.count; i++) {
-			huawei_wmi_debugfs_call_dump(m, huawei, &obj->package.elements[i]);
-			if (i < obj->package.count - 1)
-				seq_puts(m, ",");
-		}
-		seq_puts(m, "]");
-		break;
-	default:
-		dev_err(huawei->dev, "Unexpected obj type, got %d\n", obj->type);
-		return;
-	}
+	*ppos += count;
+	return count;
 }
 
-static int huawei_wmi_debugfs_call_show(struct seq_file *m, void *data)
+static const struct file_operations huawei_wmi_debugfs_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = huawei_wmi_debugfs_replay_write,
+	.llseek = default_llseek,
+};
+
+static void huawei_wmi_fake_replay_work(struct work_struct *work)
 {
-	struct huawei_wmi *huawei = m->private;
-	struct acpi_buffer out = { ACPI_ALLOCATE_BUFFER, NULL };
-	struct acpi_buffer in;
-	union acpi_object *obj;
-	int err;
+	struct huawei_wmi_replay_work *replay = container_of(to_delayed_work(work),
+		struct huawei_wmi_replay_work, work);
 
-	in.length = sizeof(u64);
-	in.pointer = &huawei->debug.arg;
+	huawei_wmi_cmd_decode_prio(replay->huawei, replay->arg, NULL, NULL,
+		replay->prio);
+}
 
-	err = huawei_wmi_call(huawei, &in, &out);
-	if (err)
-		return err;
+/* Any write reissues the loaded recording through the command path with the
+ * recorded priorities and spacing, to reproduce its contention.
+ */
+static ssize_t huawei_wmi_debugfs_replay_start_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct huawei_wmi *huawei = file->private_data;
+	struct huawei_wmi_fake *fake = &huawei->fake;
+	struct huawei_wmi_replay_work *works;
+	unsigned int i, n;
+	u64 ts0, ts;
+
+	huawei_wmi_fake_replay_stop(huawei);
+
+	mutex_lock(&fake->replay_lock);
+	huawei_wmi_debugfs_lock(huawei);
+	n = fake->replay_count;
+	works = n ? kvcalloc(n, sizeof(*works), GFP_KERNEL) : NULL;
+	if (!works) {
+		huawei_wmi_unlock(huawei);
+		mutex_unlock(&fake->replay_lock);
+		return n ? -ENOMEM : -ENODATA;
+	}
 
-	obj = out.pointer;
-	if (!obj) {
-		err = -EIO;
-		goto fail_debugfs_call;
+	ts0 = le64_to_cpu(fake->replay[0].ts);
+	for (i = 0; i < n; i++) {
+		ts = le64_to_cpu(fake->replay[i].ts);
+		INIT_DELAYED_WORK(&works[i].work, huawei_wmi_fake_replay_work);
+		works[i].huawei = huawei;
+		works[i].arg = le64_to_cpu(fake->replay[i].arg);
+		works[i].prio = min_t(int, fake->replay[i].prio,
+			HWMI_PRIO_BACKGROUND);
+		queue_delayed_work(huawei_wmi_wq, &works[i].work,
+			ts > ts0 ? nsecs_to_jiffies(ts - ts0) : 0);
 	}
+	fake->replay_cursor = 0;
+	huawei_wmi_unlock(huawei);
 
-	huawei_wmi_debugfs_call_dump(m, huawei, obj);
+	fake->replay_works = works;
+	fake->replay_works_count = n;
+	mutex_unlock(&fake->replay_lock);
 
-fail_debugfs_call:
-	kfree(out.pointer);
-	return err;
+	return count;
 }
 
-DEFINE_SHOW_ATTRIBUTE(huawei_wmi_debugfs_call);
+static const struct file_operations huawei_wmi_debugfs_replay_start_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = huawei_wmi_debugfs_replay_start_write,
+	.llseek = default_llseek,
+};
 
 static void huawei_wmi_debugfs_setup(struct device *dev)
 {
 	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+	struct dentry *ttl, *timeout, *breaker, *throttle, *slot, *fake, *snap;
+	struct dentry *age;
+	int i;
 
 	huawei->debug.root = debugfs_create_dir("huawei-wmi", NULL);
 
@@ -1528,6 +4894,109 @@ static void huawei_wmi_debugfs_setup(struct device *dev)
 		&huawei->debug.arg);
 	debugfs_create_file("call", 0400,
 		huawei->debug.root, huawei, &huawei_wmi_debugfs_call_fops);
+
+	debugfs_create_file("retry", 0600,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_retry_fops);
+	debugfs_create_file("latency", 0600,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_latency_fops);
+	debugfs_create_file("sched", 0400,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_sched_fops);
+	debugfs_create_file("slow", 0400,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_slow_fops);
+	debugfs_create_file("utilization", 0400,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_util_fops);
+	debugfs_create_file("counters", 0400,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_counters_fops);
+	debugfs_create_file("lockstat", 0600,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_lockstat_fops);
+	debugfs_create_file("caps", 0600,
+		huawei->debug.root, huawei, &huawei_wmi_debugfs_caps_fops);
+	if (huawei->rec.size)
+		debugfs_create_file("recorder", 0400, huawei->debug.root,
+			huawei, &huawei_wmi_debugfs_recorder_fops);
+	debugfs_create_u32("slow_ms", 0644, huawei->debug.root,
+		&huawei->wdog.slow_ms);
+	timeout = debugfs_create_dir("lock_timeout_ms", huawei->debug.root);
+	debugfs_create_u32("read", 0644, timeout, &huawei->wdog.read_ms);
+	debugfs_create_u32("interactive", 0644, timeout,
+		&huawei->wdog.interactive_ms);
+
+	breaker = debugfs_create_dir("breaker", huawei->debug.root);
+	debugfs_create_file("state", 0400, breaker, huawei,
+		&huawei_wmi_debugfs_breaker_fops);
+	debugfs_create_u32("threshold", 0644, breaker,
+		&huawei->breaker.threshold);
+	debugfs_create_u32("backoff_ms", 0644, breaker,
+		&huawei->breaker.backoff_ms);
+	debugfs_create_u32("backoff_max_ms", 0644, breaker,
+		&huawei->breaker.backoff_max_ms);
+
+	debugfs_create_u64("cache_hits", 0444, huawei->debug.root,
+		&huawei->cache.hits);
+	debugfs_create_u64("cache_misses", 0444, huawei->debug.root,
+		&huawei->cache.misses);
+	debugfs_create_u64("flights_issued", 0444, huawei->debug.root,
+		&huawei->flights.issued);
+	debugfs_create_u64("flights_saved", 0444, huawei->debug.root,
+		&huawei->flights.saved);
+	debugfs_create_u64("flights_exhausted", 0444, huawei->debug.root,
+		&huawei->flights.exhausted);
+	debugfs_create_u64("async_queued", 0444, huawei->debug.root,
+		&huawei->async.queued);
+	debugfs_create_u64("async_coalesced", 0444, huawei->debug.root,
+		&huawei->async.coalesced);
+	debugfs_create_u64("shape_fallbacks", 0444, huawei->debug.root,
+		&huawei->shape_fallbacks);
+	debugfs_create_u64("resp_reused", 0444, huawei->debug.root,
+		&huawei->resp.reused);
+	debugfs_create_u64("resp_allocs", 0444, huawei->debug.root,
+		&huawei->resp.allocs);
+	ttl = debugfs_create_dir("cache_ttl_ms", huawei->debug.root);
+	for (i = 0; i < ARRAY_SIZE(hwmi_cache_policies); i++)
+		debugfs_create_u32(hwmi_cache_policies[i].name, 0644, ttl,
+			&hwmi_cache_policies[i].ttl_ms);
+
+	snap = debugfs_create_dir("snapshot", huawei->debug.root);
+	debugfs_create_file("state", 0400, snap, huawei,
+		&huawei_wmi_debugfs_snapshot_fops);
+	for (i = 0; i < HWMI_SNAP_MAX; i++)
+		debugfs_create_bool(hwmi_snap_modes[i].name, 0644, snap,
+			&hwmi_snap_modes[i].snapshot);
+	age = debugfs_create_dir("max_age_ms", snap);
+	for (i = 0; i < HWMI_SNAP_MAX; i++)
+		debugfs_create_u32(hwmi_snap_modes[i].name, 0644, age,
+			&hwmi_snap_modes[i].max_age_ms);
+
+	throttle = debugfs_create_dir("throttle", huawei->debug.root);
+	debugfs_create_file("stats", 0400, throttle, huawei,
+		&huawei_wmi_debugfs_throttle_fops);
+	for (i = 0; i < HWMI_ASYNC_MAX; i++) {
+		slot = debugfs_create_dir(hwmi_async_names[i], throttle);
+		debugfs_create_u32("rate", 0644, slot,
+			&huawei->async.slots[i].rate);
+		debugfs_create_u32("burst", 0644, slot,
+			&huawei->async.slots[i].burst);
+	}
+
+	if (huawei->ops == &huawei_wmi_fake_ops) {
+		fake = debugfs_create_dir("fake", huawei->debug.root);
+		debugfs_create_u32("shape", 0644, fake, &huawei->fake.shape);
+		debugfs_create_u32("latency_us", 0644, fake,
+			&huawei->fake.latency_us);
+		debugfs_create_u32("err_every", 0644, fake,
+			&huawei->fake.err_every);
+		debugfs_create_x32("err_cmd", 0644, fake, &huawei->fake.err_cmd);
+		debugfs_create_bool("retry_quirk", 0644, fake,
+			&huawei->fake.retry_quirk);
+		debugfs_create_u8("fans", 0644, fake, &huawei->fake.fans);
+		debugfs_create_u64("evals", 0444, fake, &huawei->fake.evals);
+		debugfs_create_file("replay", 0200, fake, huawei,
+			&huawei_wmi_debugfs_replay_fops);
+		debugfs_create_file("replay_start", 0200, fake, huawei,
+			&huawei_wmi_debugfs_replay_start_fops);
+		debugfs_create_u64("replayed", 0444, fake,
+			&huawei->fake.replayed);
+	}
 }
 
 static void huawei_wmi_debugfs_exit(struct device *dev)
@@ -1539,10 +5008,76 @@ static void huawei_wmi_debugfs_exit(struct device *dev)
 
 /* Input */
 
+static bool huawei_wmi_key_filtered(const struct key_entry *key)
+{
+	if (quirks && !quirks->report_brightness &&
+			(key->sw.code == KEY_BRIGHTNESSDOWN ||
+			key->sw.code == KEY_BRIGHTNESSUP))
+		return true;
+
+	if (quirks && !quirks->report_volume &&
+			(key->sw.code == KEY_VOLUMEUP ||
+			key->sw.code == KEY_VOLUMEDOWN ||
+			key->sw.code == KEY_MUTE))
+		return true;
+
+	return false;
+}
+
+/* Some keys are only reported after the firmware acted on them. Keep the
+ * cache and the snapshot in line with what it did, rather than having the
+ * next read find out from the EC.
+ */
+static void huawei_wmi_key_state(struct huawei_wmi *huawei, int code)
+{
+	int level;
+
+	switch (code) {
+	case KBDLIGHT_KEY_0:
+	case KBDLIGHT_KEY_1:
+	case KBDLIGHT_KEY_2:
+		/* We set it ourselves below, which publishes it. */
+		if (quirks && quirks->handle_kbdlight)
+			return;
+		level = code - KBDLIGHT_KEY_0;
+		break;
+	case KBDLIGHT_KEY_OFF:
+	case KBDLIGHT_KEY_LOW:
+	case KBDLIGHT_KEY_HIGH:
+		level = code - KBDLIGHT_KEY_OFF;
+		break;
+	case KBDLIGHT_KEY_AUTO:
+		/* The level is up to the light sensor now. */
+		huawei_wmi_cache_invalidate(huawei, KBDLIGHT_SET);
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_KBDLIGHT, 1);
+		return;
+	case 0x2a0:
+	case 0x2a1:
+	case 0x2a6:
+		/* Doesn't tell which way it went. */
+		huawei_wmi_cache_invalidate(huawei, POWER_UNLOCK_SET);
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_POWER_UNLOCK, 1);
+		return;
+	default:
+		return;
+	}
+
+	huawei_wmi_cache_invalidate(huawei, KBDLIGHT_SET);
+	/* Keys can come in before discovery, and on auto models the key
+	 * levels don't map to the ones KBDLIGHT_GET reports.
+	 */
+	if (smp_load_acquire(&huawei->kbdlight_available) &&
+			!(quirks && quirks->kbdlight_auto))
+		huawei_wmi_snap_put(huawei, HWMI_STATE_KBDLIGHT, &level, 1);
+	else
+		huawei_wmi_snap_forget(huawei, HWMI_STATE_KBDLIGHT, 1);
+}
+
 static void huawei_wmi_process_key(struct input_dev *idev, int code)
 {
-	struct huawei_wmi *huawei = dev_get_drvdata(idev->dev.parent);
+	struct huawei_wmi *huawei;
 	const struct key_entry *key;
+	bool filtered;
 
 	/*
 	 * WMI0 uses code 0x80 to indicate a hotkey event.
@@ -1550,186 +5085,356 @@ static void huawei_wmi_process_key(struct input_dev *idev, int code)
 	 * using WMI0_EXPENSIVE_GUID.
 	 */
 	if (code == 0x80) {
-		struct acpi_buffer response = { ACPI_ALLOCATE_BUFFER, NULL };
-		union acpi_object *obj;
-		acpi_status status;
+		union acpi_object *obj = NULL;
 
-		status = wmi_query_block(WMI0_EXPENSIVE_GUID, 0, &response);
-		if (ACPI_FAILURE(status))
+		mutex_lock(&huawei_wmi_link_lock);
+		if (huawei_wmi_wmi0)
+			obj = wmidev_block_query(huawei_wmi_wmi0, 0);
+		mutex_unlock(&huawei_wmi_link_lock);
+		if (!obj)
 			return;
 
-		obj = (union acpi_object *)response.pointer;
-		if (obj && obj->type == ACPI_TYPE_INTEGER)
+		if (obj->type == ACPI_TYPE_INTEGER)
 			code = obj->integer.value;
 
-		kfree(response.pointer);
+		kfree(obj);
 	}
 
 	key = sparse_keymap_entry_from_scancode(idev, code);
 	if (!key) {
+		trace_huawei_wmi_key(code, KEY_RESERVED, true);
 		dev_info(&idev->dev, "Unknown key pressed, code: 0x%04x\n", code);
 		return;
 	}
 
-	if (quirks && !quirks->report_brightness &&
-			(key->sw.code == KEY_BRIGHTNESSDOWN ||
-			key->sw.code == KEY_BRIGHTNESSUP))
-		return;
+	huawei = huawei_wmi_get();
+	if (huawei)
+		huawei_wmi_key_state(huawei, key->code);
 
-	if (quirks && !quirks->report_volume &&
-			(key->sw.code == KEY_VOLUMEUP ||
-			key->sw.code == KEY_VOLUMEDOWN ||
-			key->sw.code == KEY_MUTE))
-		return;
+	filtered = huawei_wmi_key_filtered(key);
+	trace_huawei_wmi_key(code, key->keycode, filtered);
+	if (filtered)
+		goto out;
 
-	if (quirks && quirks->handle_kbdlight && huawei->kbdlight_available &&
+	if (quirks && quirks->handle_kbdlight &&
 			(key->code == KBDLIGHT_KEY_0 ||
 			key->code == KBDLIGHT_KEY_1 ||
-			key->code == KBDLIGHT_KEY_2)) {
-		huawei_wmi_kbdlight_set(key->code - KBDLIGHT_KEY_0);
-	}
+			key->code == KBDLIGHT_KEY_2) &&
+			huawei && smp_load_acquire(&huawei->kbdlight_available))
+		__huawei_wmi_kbdlight_set(huawei, key->code - KBDLIGHT_KEY_0,
+				HWMI_PRIO_INTERACTIVE);
 
 	sparse_keymap_report_entry(idev, key, 1, true);
-}
-
-static void huawei_wmi_input_notify(union acpi_object *obj, void *context)
-{
-	struct input_dev *idev = (struct input_dev *)context;
 
-	if (obj && obj->type == ACPI_TYPE_INTEGER)
-		huawei_wmi_process_key(idev, obj->integer.value);
-	else
-		dev_err(&idev->dev, "Bad response type\n");
+out:
+	if (huawei)
+		huawei_wmi_put(huawei);
 }
 
-static int huawei_wmi_input_setup(struct device *dev,
-		const char *guid,
+static int huawei_wmi_input_setup(struct wmi_device *wdev,
 		struct input_dev **idev)
 {
-	*idev = devm_input_allocate_device(dev);
+	int err;
+
+	*idev = devm_input_allocate_device(&wdev->dev);
 	if (!*idev)
 		return -ENOMEM;
 
 	(*idev)->name = "Huawei WMI hotkeys";
 	(*idev)->phys = "wmi/input0";
 	(*idev)->id.bustype = BUS_HOST;
-	(*idev)->dev.parent = dev;
+	(*idev)->dev.parent = &wdev->dev;
 
-	return sparse_keymap_setup(*idev, huawei_wmi_keymap, NULL) ||
-		input_register_device(*idev) ||
-		wmi_install_notify_handler(guid, huawei_wmi_input_notify,
-				*idev);
+	err = sparse_keymap_setup(*idev, huawei_wmi_keymap, NULL);
+	if (err)
+		return err;
+
+	return input_register_device(*idev);
 }
 
-static void huawei_wmi_input_exit(struct device *dev, const char *guid)
+/* Huawei driver */
+
+/* Feature discovery */
+
+static ssize_t discovery_show(struct device *dev,
+		struct device_attribute *attr,
+		char *buf)
 {
-	wmi_remove_notify_handler(guid);
+	struct huawei_wmi *huawei = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n",
+			smp_load_acquire(&huawei->discovered) ? "done" : "running");
 }
 
-/* Huawei driver */
+static DEVICE_ATTR_RO(discovery);
 
-static const struct wmi_device_id huawei_wmi_events_id_table[] = {
-	{ .guid_string = WMI0_EVENT_GUID },
-	{ .guid_string = HWMI_EVENT_GUID },
-	{  }
-};
+/* Adds the attributes of each feature the firmware confirms, in the
+ * background class. Userspace can poll discovery to learn when it's done.
+ */
+static void huawei_wmi_discover_work(struct work_struct *work)
+{
+	struct huawei_wmi *huawei = container_of(work, struct huawei_wmi,
+		discover);
+	struct device *dev = huawei->dev;
+
+	huawei_wmi_caps_setup(huawei);
+
+	/* Hotkeys come in meanwhile. Each feature is only flagged available,
+	 * with a release paired with their acquire, once its probe succeeded.
+	 */
+	if (huawei->hwmon) {
+		huawei_wmi_fan_speed_setup(dev);
+		huawei_wmi_temp_setup(dev);
+	}
+	huawei_wmi_smart_charge_setup(dev);
+	huawei_wmi_smart_charge_param_setup(dev);
+	huawei_wmi_power_unlock_setup(dev);
+	huawei_wmi_kbdlight_timeout_setup(dev);
+	huawei_wmi_kbdlight_setup(dev);
+	huawei_wmi_leds_setup(dev);
+	huawei_wmi_fn_lock_setup(dev);
+	huawei_wmi_battery_setup(dev);
+
+	smp_store_release(&huawei->discovered, true);
+	sysfs_notify(&dev->kobj, NULL, "discovery");
+}
 
 static int huawei_wmi_probe(struct platform_device *pdev)
 {
-	const struct wmi_device_id *guid = huawei_wmi_events_id_table;
-	struct input_dev *idev = *huawei_wmi->idev;
-	int err;
+	struct wmi_device **wdev = dev_get_platdata(&pdev->dev);
+	struct huawei_wmi *huawei;
+	int i;
 
-	platform_set_drvdata(pdev, huawei_wmi);
-	huawei_wmi->dev = &pdev->dev;
+	huawei = devm_kzalloc(&pdev->dev, sizeof(*huawei), GFP_KERNEL);
+	if (!huawei)
+		return -ENOMEM;
 
-	while (*guid->guid_string) {
-		if (wmi_has_guid(guid->guid_string)) {
-			err = huawei_wmi_input_setup(&pdev->dev, guid->guid_string, &idev);
-			if (err) {
-				dev_err(&pdev->dev, "Failed to setup input on %s\n", guid->guid_string);
-				return err;
-			}
-		}
+	platform_set_drvdata(pdev, huawei);
+	huawei->dev = &pdev->dev;
+
+	huawei->stats = devm_alloc_percpu(&pdev->dev, struct huawei_wmi_stats);
+	if (!huawei->stats)
+		return -ENOMEM;
 
-		idev++;
-		guid++;
+	if (wdev) {
+		huawei->wdev = *wdev;
+		huawei->ops = &huawei_wmi_wmi_ops;
+	} else {
+		huawei->ops = &huawei_wmi_fake_ops;
+		huawei_wmi_fake_init(&huawei->fake);
 	}
 
-	if (wmi_has_guid(HWMI_METHOD_GUID)) {
-		mutex_init(&huawei_wmi->wmi_lock);
+	if (!huawei->ops->present(huawei))
+		return -ENODEV;
 
-		huawei_wmi->hwmon = hwmon_device_register_with_groups(&pdev->dev, "huawei_wmi", NULL, NULL);
-		if (IS_ERR(huawei_wmi->hwmon))
-		{
-			huawei_wmi->hwmon = NULL;
-		}
-		else
-		{
-			huawei_wmi_fan_speed_setup(&pdev->dev);
-			huawei_wmi_temp_setup(&pdev->dev);
+	mutex_init(&huawei->wmi_lock);
+	mutex_init(&huawei->fake.replay_lock);
+	spin_lock_init(&huawei->cache.lock);
+	spin_lock_init(&huawei->flights.lock);
+	spin_lock_init(&huawei->breaker.lock);
+	INIT_DELAYED_WORK(&huawei->breaker.work, huawei_wmi_breaker_work);
+	huawei->breaker.threshold = 3;
+	huawei->breaker.backoff_ms = 1000;
+	huawei->breaker.backoff_max_ms = 300000;
+	INIT_LIST_HEAD(&huawei->flights.list);
+	spin_lock_init(&huawei->async.lock);
+	mutex_init(&huawei->async.apply_lock);
+	spin_lock_init(&huawei->sched.lock);
+	init_waitqueue_head(&huawei->sched.wq);
+	spin_lock_init(&huawei->wdog.lock);
+	spin_lock_init(&huawei->util.lock);
+	spin_lock_init(&huawei->lockstat.lock);
+	huawei->lockstat.feat_cur = HWMI_FEAT_NONE;
+	seqlock_init(&huawei->snap.lock);
+	huawei->user = HWMI_FEAT_NONE;
+	huawei->wdog.slow_ms = 1000;
+	huawei->wdog.read_ms = 2000;
+	huawei->wdog.interactive_ms = 200;
+	if (record) {
+		huawei->rec.size = roundup_pow_of_two(min(record, 1U << 20));
+		huawei->rec.recs = kvcalloc(huawei->rec.size,
+			sizeof(*huawei->rec.recs), GFP_KERNEL);
+		if (!huawei->rec.recs) {
+			dev_warn(&pdev->dev, "Failed to allocate the recorder\n");
+			huawei->rec.size = 0;
 		}
-		huawei_wmi_smart_charge_setup(&pdev->dev);
-		huawei_wmi_smart_charge_param_setup(&pdev->dev);
-		huawei_wmi_power_unlock_setup(&pdev->dev);
-		huawei_wmi_kbdlight_timeout_setup(&pdev->dev);
-		huawei_wmi_kbdlight_setup(&pdev->dev);
-		huawei_wmi_leds_setup(&pdev->dev);
-		huawei_wmi_fn_lock_setup(&pdev->dev);
-		huawei_wmi_battery_setup(&pdev->dev);
-		huawei_wmi_debugfs_setup(&pdev->dev);
+	}
+	INIT_DELAYED_WORK(&huawei->async.work, huawei_wmi_async_work);
+	for (i = 0; i < HWMI_ASYNC_MAX; i++) {
+		huawei->async.slots[i].rate = hwmi_async_budgets[i][0];
+		huawei->async.slots[i].burst = hwmi_async_budgets[i][1];
 	}
 
+	mutex_lock(&huawei_wmi_link_lock);
+	huawei_wmi_method = huawei;
+	mutex_unlock(&huawei_wmi_link_lock);
+
+	huawei->hwmon = hwmon_device_register_with_groups(&pdev->dev, "huawei_wmi", huawei, NULL);
+	if (IS_ERR(huawei->hwmon))
+		huawei->hwmon = NULL;
+
+	device_create_file(&pdev->dev, &dev_attr_discovery);
+	huawei_wmi_debugfs_setup(&pdev->dev);
+
+	/* Every feature costs an evaluation or two, don't hold up boot. */
+	INIT_WORK(&huawei->discover, huawei_wmi_discover_work);
+	queue_work(huawei_wmi_wq, &huawei->discover);
+
 	return 0;
 }
 
 static void huawei_wmi_remove(struct platform_device *pdev)
 {
-	const struct wmi_device_id *guid = huawei_wmi_events_id_table;
-
-	while (*guid->guid_string) {
-		if (wmi_has_guid(guid->guid_string))
-			huawei_wmi_input_exit(&pdev->dev, guid->guid_string);
-
-		guid++;
-	}
-
-	if (wmi_has_guid(HWMI_METHOD_GUID)) {
-		huawei_wmi_debugfs_exit(&pdev->dev);
-		huawei_wmi_battery_exit(&pdev->dev);
-		huawei_wmi_fn_lock_exit(&pdev->dev);
-		huawei_wmi_kbdlight_exit(&pdev->dev);
-		huawei_wmi_kbdlight_timeout_exit(&pdev->dev);
-		huawei_wmi_power_unlock_exit(&pdev->dev);
-		huawei_wmi_smart_charge_exit(&pdev->dev);
-		huawei_wmi_smart_charge_param_exit(&pdev->dev);
-		if (huawei_wmi->hwmon)
-		{
-			huawei_wmi_temp_exit(&pdev->dev);
-			huawei_wmi_fan_speed_exit(&pdev->dev);
-			hwmon_device_unregister(huawei_wmi->hwmon);
-		}
-
+	struct huawei_wmi *huawei = platform_get_drvdata(pdev);
+
+	/* Waits for discovery if it's running, or keeps it from starting. */
+	cancel_work_sync(&huawei->discover);
+	device_remove_file(&pdev->dev, &dev_attr_discovery);
+	huawei_wmi_debugfs_exit(&pdev->dev);
+	huawei_wmi_fake_replay_stop(huawei);
+	huawei_wmi_battery_exit(&pdev->dev);
+	huawei_wmi_fn_lock_exit(&pdev->dev);
+	huawei_wmi_kbdlight_exit(&pdev->dev);
+	huawei_wmi_kbdlight_timeout_exit(&pdev->dev);
+	huawei_wmi_power_unlock_exit(&pdev->dev);
+	huawei_wmi_smart_charge_exit(&pdev->dev);
+	huawei_wmi_smart_charge_param_exit(&pdev->dev);
+	if (huawei->hwmon)
+	{
+		huawei_wmi_temp_exit(&pdev->dev);
+		huawei_wmi_fan_speed_exit(&pdev->dev);
+		hwmon_device_unregister(huawei->hwmon);
 	}
+
+	/* Don't drop writes userspace was already told about, budget or not.
+	 * Nothing can queue more once the attributes are gone.
+	 */
+	spin_lock(&huawei->async.lock);
+	huawei->async.draining = true;
+	spin_unlock(&huawei->async.lock);
+	flush_delayed_work(&huawei->async.work);
+	cancel_delayed_work_sync(&huawei->async.work);
+	cancel_delayed_work_sync(&huawei->breaker.work);
+
+	mutex_lock(&huawei_wmi_link_lock);
+	huawei_wmi_method = NULL;
+	mutex_unlock(&huawei_wmi_link_lock);
+	wait_var_event(&huawei->users, !atomic_read(&huawei->users));
+
+	kvfree(huawei->fake.replay);
+	kvfree(huawei->rec.recs);
 }
 
 static struct platform_driver huawei_wmi_driver = {
 	.driver = {
 		.name = "huawei-wmi",
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = huawei_wmi_probe,
 	.remove = huawei_wmi_remove,
 };
 
-static __init int huawei_wmi_init(void)
+/* WMI driver */
+
+static int huawei_wmi_wdev_probe(struct wmi_device *wdev, const void *context)
 {
-	struct platform_device *pdev;
+	struct huawei_wmi_wdev *priv;
 	int err;
 
-	huawei_wmi = kzalloc(sizeof(struct huawei_wmi), GFP_KERNEL);
-	if (!huawei_wmi)
+	priv = devm_kzalloc(&wdev->dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
 		return -ENOMEM;
 
+	priv->role = (uintptr_t)context;
+	dev_set_drvdata(&wdev->dev, priv);
+
+	switch (priv->role) {
+	case HWMI_ROLE_METHOD:
+		/* The fake backend registers its own device. */
+		if (sysfs_streq(backend, "fake"))
+			return -ENODEV;
+
+		/* Not parented to the WMI device to keep the device path
+		 * userspace knows, /sys/devices/platform/huawei-wmi.
+		 */
+		priv->pdev = platform_device_register_data(NULL, "huawei-wmi",
+				PLATFORM_DEVID_NONE, &wdev, sizeof(wdev));
+		return PTR_ERR_OR_ZERO(priv->pdev);
+	case HWMI_ROLE_EVENT:
+		err = huawei_wmi_input_setup(wdev, &priv->idev);
+		if (err)
+			dev_err(&wdev->dev, "Failed to setup input, err %d\n", err);
+		return err;
+	case HWMI_ROLE_WMI0:
+		mutex_lock(&huawei_wmi_link_lock);
+		huawei_wmi_wmi0 = wdev;
+		mutex_unlock(&huawei_wmi_link_lock);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static void huawei_wmi_wdev_remove(struct wmi_device *wdev)
+{
+	struct huawei_wmi_wdev *priv = dev_get_drvdata(&wdev->dev);
+
+	switch (priv->role) {
+	case HWMI_ROLE_METHOD:
+		platform_device_unregister(priv->pdev);
+		break;
+	case HWMI_ROLE_WMI0:
+		mutex_lock(&huawei_wmi_link_lock);
+		huawei_wmi_wmi0 = NULL;
+		mutex_unlock(&huawei_wmi_link_lock);
+		break;
+	}
+}
+
+static void huawei_wmi_wdev_notify(struct wmi_device *wdev,
+		union acpi_object *obj)
+{
+	struct huawei_wmi_wdev *priv = dev_get_drvdata(&wdev->dev);
+
+	if (priv->role != HWMI_ROLE_EVENT)
+		return;
+
+	if (obj && obj->type == ACPI_TYPE_INTEGER)
+		huawei_wmi_process_key(priv->idev, obj->integer.value);
+	else
+		dev_err(&wdev->dev, "Bad response type\n");
+}
+
+static const struct wmi_device_id huawei_wmi_id_table[] = {
+	{ .guid_string = HWMI_METHOD_GUID, .context = (void *)HWMI_ROLE_METHOD },
+	{ .guid_string = HWMI_EVENT_GUID, .context = (void *)HWMI_ROLE_EVENT },
+	{ .guid_string = WMI0_EVENT_GUID, .context = (void *)HWMI_ROLE_EVENT },
+	{ .guid_string = WMI0_EXPENSIVE_GUID, .context = (void *)HWMI_ROLE_WMI0 },
+	{  }
+};
+
+static struct wmi_driver huawei_wmi_wmi_driver = {
+	.driver = {
+		.name = "huawei-wmi",
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.id_table = huawei_wmi_id_table,
+	.probe = huawei_wmi_wdev_probe,
+	.remove = huawei_wmi_wdev_remove,
+	.notify = huawei_wmi_wdev_notify,
+};
+
+static struct platform_device *huawei_wmi_fake_pdev;
+
+static __init int huawei_wmi_init(void)
+{
+	int err;
+
+	if (!sysfs_streq(backend, "wmi") && !sysfs_streq(backend, "fake")) {
+		pr_err(KBUILD_MODNAME ": unknown backend \"%s\"\n", backend);
+		return -EINVAL;
+	}
+
 	quirks = &quirk_unknown;
 	dmi_check_system(huawei_quirks);
 	if (battery_reset != -1)
@@ -1743,39 +5448,51 @@ static __init int huawei_wmi_init(void)
 	if (kbdlight_auto != -1)
 		quirks->kbdlight_auto = kbdlight_auto;
 
+	huawei_wmi_wq = alloc_workqueue("huawei-wmi", WQ_UNBOUND | WQ_SYSFS, 0);
+	if (!huawei_wmi_wq)
+		return -ENOMEM;
+
 	err = platform_driver_register(&huawei_wmi_driver);
 	if (err)
-		goto pdrv_err;
-
-	pdev = platform_device_register_simple("huawei-wmi", -1, NULL, 0);
-	if (IS_ERR(pdev)) {
-		err = PTR_ERR(pdev);
-		goto pdev_err;
+		goto drv_err;
+
+	/* There's no WMI device behind the fake backend. */
+	if (sysfs_streq(backend, "fake")) {
+		huawei_wmi_fake_pdev = platform_device_register_simple("huawei-wmi", -1, NULL, 0);
+		if (IS_ERR(huawei_wmi_fake_pdev)) {
+			err = PTR_ERR(huawei_wmi_fake_pdev);
+			huawei_wmi_fake_pdev = NULL;
+			goto pdev_err;
+		}
 	}
+
+	err = wmi_driver_register(&huawei_wmi_wmi_driver);
+	if (err)
+		goto wdrv_err;
+
 	return 0;
 
+wdrv_err:
+	platform_device_unregister(huawei_wmi_fake_pdev);
 pdev_err:
 	platform_driver_unregister(&huawei_wmi_driver);
-pdrv_err:
-	kfree(huawei_wmi);
+drv_err:
+	destroy_workqueue(huawei_wmi_wq);
 	return err;
 }
 
 static __exit void huawei_wmi_exit(void)
 {
-	struct platform_device *pdev = to_platform_device(huawei_wmi->dev);
-
-	platform_device_unregister(pdev);
+	wmi_driver_unregister(&huawei_wmi_wmi_driver);
+	platform_device_unregister(huawei_wmi_fake_pdev);
 	platform_driver_unregister(&huawei_wmi_driver);
-
-	kfree(huawei_wmi);
+	destroy_workqueue(huawei_wmi_wq);
 }
 
 module_init(huawei_wmi_init);
 module_exit(huawei_wmi_exit);
 
-MODULE_ALIAS("wmi:"HWMI_METHOD_GUID);
-MODULE_DEVICE_TABLE(wmi, huawei_wmi_events_id_table);
+MODULE_DEVICE_TABLE(wmi, huawei_wmi_id_table);
 MODULE_AUTHOR("Ayman Bagabas <ayman.bagabas@gmail.com>");
 MODULE_DESCRIPTION("Huawei WMI laptop extras driver");
 MODULE_LICENSE("GPL v2");